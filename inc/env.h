@@ -6,6 +6,7 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/rbtree.h>
 
 typedef int32_t envid_t;
 
@@ -29,6 +30,32 @@ typedef int32_t envid_t;
 #define NENV                    (1 << LOG2NENV)
 #define ENVX(envid)             ((envid) & (NENV - 1))
 
+// estRunTime is counted in units of 1 << ESTRUNTIME_SHIFT TSC cycles
+#define ESTRUNTIME_SHIFT        10
+
+// CPU share weights for the completely-fair scheduler (SCHED_CFS).
+// An env's share is proportional to its weight.  The range matches
+// Linux's nice levels +19 (ENV_WEIGHT_MIN) to -20 (ENV_WEIGHT_MAX).
+#define ENV_WEIGHT_DEFAULT      1024
+#define ENV_WEIGHT_MIN          15
+#define ENV_WEIGHT_MAX          88761
+
+// Tickets for stride scheduling (SCHED_STRIDE).  Each runnable env
+// receives CPU time in proportion to the tickets it holds.
+#define ENV_TICKETS_DEFAULT     100
+#define ENV_TICKETS_MAX         (1 << 16)
+
+// Priority levels for the multi-level feedback queue (SCHED_MLFQ).
+// Level 0 is the highest priority.
+#define MLFQ_LEVELS             4
+
+// Real-time reservation periods and budgets are counted in units of
+// 1 << RT_TIME_SHIFT TSC cycles.
+#define RT_TIME_SHIFT           10
+
+// Bit i of env_affinity allows the env to run on CPU i.
+#define ENV_AFFINITY_ALL        (~(uint32_t)0)
+
 // Values of env_status in struct Env
 enum {
   ENV_FREE = 0,
@@ -41,11 +68,8 @@ enum {
 // Special environment types
 enum EnvType {
   ENV_TYPE_USER = 0,
-  ENV_TYPE_TIME,
 };
 
-struct Env* ticker;
-
 struct Env {
   struct Trapframe env_tf;              // Saved registers
   struct Env *env_link;                 // Next free Env
@@ -55,6 +79,16 @@ struct Env {
   unsigned env_status;                  // Status of the environment
   uint32_t env_runs;                    // Number of times environment has run
   int env_cpunum;                       // The CPU that the env is running on
+  uint32_t env_affinity;                // CPUs the env may run on
+  envid_t env_gang;                     // Gang co-scheduled with, or 0
+
+  // Scheduler run queue linkage (kern/sched.c)
+  struct RunQueue *env_runq;            // Run queue holding this env, or NULL
+  struct Env *env_rq_next;              // Next env on env_runq
+  struct Env *env_rq_prev;              // Previous env on env_runq
+  struct rb_node env_rq_node;           // Node in a tree-ordered env_runq
+  struct Env *env_gang_next;            // Next queued env of the same gang
+  struct Env *env_gang_prev;            // Previous queued env of the gang
 
   // Address space
   pde_t *env_pgdir;                     // Kernel virtual address of page dir
@@ -71,6 +105,41 @@ struct Env {
 
   //Benchmark Additions
   uint32_t estRunTime;                  // Estimated Runtime Given by Program
+                                        // (units of 1 << ESTRUNTIME_SHIFT
+                                        // TSC cycles; 0 if unknown)
+  uint64_t env_cputime;                 // TSC cycles spent in user mode
+  uint64_t env_systime;                 // TSC cycles in the kernel for us
+  uint64_t env_waittime;                // TSC cycles runnable but queued
+  uint32_t env_nvcsw;                   // Voluntary context switches
+  uint32_t env_nivcsw;                  // Involuntary (preempted) switches
+  uint64_t env_start_nsec;              // time_nsec() when created
+  uint64_t env_first_nsec;              // time_nsec() when first run
+  uint64_t env_tsc_in;                  // TSC at last entry to user mode
+  uint64_t env_tsc_out;                 // TSC at last exit from user mode
+  uint64_t env_tsc_queued;              // TSC when last put on env_runq
+  bool env_preempted;                   // Being switched out involuntarily
+  uint64_t env_vruntime;                // CPU time scaled by 1/env_weight
+  uint32_t env_weight;                  // CFS weight (ENV_WEIGHT_DEFAULT)
+  uint64_t env_pass;                    // Stride pass
+  uint32_t env_tickets;                 // Stride tickets
+  uint32_t env_tickets_lent;            // Tickets lent to us by blocked envs
+  envid_t env_donee;                    // Env holding our tickets, or 0
+  envid_t env_ipc_to;                   // Env owing us a reply, or 0
+  int env_mlfq_level;                   // MLFQ priority level
+  int env_mlfq_ticks;                   // Timer ticks used at this level
+  uint32_t env_mlfq_epoch;              // Last MLFQ boost applied to us
+
+  // Real-time (EDF) reservation; env_rt_period is 0 for best-effort envs
+  uint32_t env_rt_period;               // Period (RT_TIME_SHIFT units)
+  uint32_t env_rt_budget;               // CPU budget per period
+  int env_rt_cpu;                       // CPU holding the reservation
+  struct Env *env_rt_next;              // Next env reserved on env_rt_cpu
+  uint64_t env_rt_deadline;             // TSC deadline of the current job
+  uint64_t env_rt_used;                 // TSC cycles used by the current job
+  bool env_rt_done;                     // Current job finished (yielded)
+  bool env_rt_ready;                    // On the CPU's EDF tree
+  uint32_t env_rt_jobs;                 // Jobs (periods) released
+  uint32_t env_rt_misses;               // Jobs short of budget at deadline
 };
 
 #endif  // !JOS_INC_ENV_H
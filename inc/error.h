@@ -16,6 +16,8 @@ enum {
 
   E_IPC_NOT_RECV,               // Attempt to send to env that is not recving
   E_EOF,                        // Unexpected end of file
+  E_NO_CPU,                     // Not enough CPU capacity for a
+                                // real-time reservation
 
   MAXERROR
 };
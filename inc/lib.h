@@ -53,6 +53,16 @@ int     sys_page_map(envid_t src_env, void *src_pg,
 int     sys_page_unmap(envid_t env, void *pg);
 int     sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int     sys_ipc_recv(void *rcv_pg);
+int     sys_env_set_runtime(envid_t env, uint32_t est);
+int     sys_env_set_weight(envid_t env, uint32_t weight);
+int     sys_env_set_tickets(envid_t env, uint32_t tickets);
+int     sys_env_set_rt(envid_t env, uint32_t period, uint32_t budget);
+int     sys_env_set_affinity(envid_t env, uint32_t mask);
+uint64_t sys_time_nsec(void);
+int     sys_sleep(uint64_t nsec);
+int     sys_yield_to(envid_t env);
+int     sys_env_set_gang(envid_t env, envid_t gang);
+int     sys_lock_bench(int kind, struct LockBench *lb);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
   // Next page on the free list.
   struct PageInfo *pp_link;
+  // Previous page on the free list (free block heads only).
+  struct PageInfo *pp_prev;
 
   // pp_ref is the count of pointers (usually in page table entries)
   // to this page, for pages allocated using page_alloc.
@@ -185,6 +187,17 @@ struct PageInfo {
   // boot_alloc do not have valid reference count fields.
 
   uint16_t pp_ref;
+
+  // The buddy allocator's state (see kern/pmap.c): whether this page
+  // heads a free block, and the block's order (its size is
+  // 1 << pp_order pages) if so or if it heads a block allocated with
+  // page_alloc_order.
+  uint8_t pp_free;
+  uint8_t pp_order;
+
+  // The slab this page is part of, if the page belongs to a kmem
+  // cache (see kern/kmalloc.c).
+  struct KmemSlab *pp_slab;
 };
 
 #endif  /* !__ASSEMBLER__ */
@@ -0,0 +1,38 @@
+#ifndef JOS_INC_RBTREE_H
+#define JOS_INC_RBTREE_H
+
+#include <inc/types.h>
+
+// Intrusive red-black tree keyed by a 64-bit integer.  Embed a
+// struct rb_node in the object, set rb_key, and use rb_entry() to get
+// back from a node to the object.  Nodes with equal keys are kept in
+// insertion order, and the tree caches its leftmost (smallest) node
+// so that finding the minimum is O(1).
+
+struct rb_node {
+  struct rb_node *rb_parent;
+  struct rb_node *rb_left;
+  struct rb_node *rb_right;
+  int rb_red;
+  uint64_t rb_key;
+};
+
+struct rb_tree {
+  struct rb_node *rb_root;
+  struct rb_node *rb_leftmost;          // Node with the smallest key
+};
+
+#define rb_entry(node, type, member) \
+  ((type *)((char *)(node) - offsetof(type, member)))
+
+void            rb_insert(struct rb_tree *t, struct rb_node *n);
+void            rb_remove(struct rb_tree *t, struct rb_node *n);
+struct rb_node *rb_next(struct rb_node *n);
+
+static inline struct rb_node *
+rb_first(struct rb_tree *t)
+{
+  return t->rb_leftmost;
+}
+
+#endif  // !JOS_INC_RBTREE_H
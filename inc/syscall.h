@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
   SYS_cputs = 0,
@@ -16,7 +18,39 @@ enum {
   SYS_yield,
   SYS_ipc_try_send,
   SYS_ipc_recv,
+  SYS_env_set_runtime,
+  SYS_env_set_weight,
+  SYS_env_set_tickets,
+  SYS_env_set_rt,
+  SYS_env_set_affinity,
+  SYS_time_nsec,
+  SYS_sleep,
+  SYS_yield_to,
+  SYS_env_set_gang,
+  SYS_lock_bench,
   NSYSCALLS
 };
 
+// Kernel spin lock implementations (see kern/spinlock.h)
+enum {
+  SPIN_TAS = 0,                 // Test-and-set
+  SPIN_TICKET,                  // FIFO ticket lock
+  SPIN_MCS,                     // FIFO queue lock, per-CPU nodes
+  NSPINKINDS
+};
+
+// Longest a sys_lock_bench run may hold up its CPU, from the call
+// to lb_end.
+#define LOCK_BENCH_MAX_NSEC     100000000ULL
+
+// One CPU's run of sys_lock_bench.  Times are in nanoseconds of the
+// kernel clock (sys_time_nsec); waits are in TSC cycles.
+struct LockBench {
+  uint64_t lb_start;            // In: start acquiring at this time
+  uint64_t lb_end;              // In: stop acquiring at this time
+  uint32_t lb_acquires;         // Out: times this CPU got the lock
+  uint64_t lb_wait;             // Out: total cycles spent waiting
+  uint64_t lb_maxwait;          // Out: longest single wait
+};
+
 #endif  /* !JOS_INC_SYSCALL_H */
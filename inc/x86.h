@@ -305,4 +305,27 @@ xchg(volatile uint32_t *addr, uint32_t newval)
   return result;
 }
 
+// Atomically add inc to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+  asm volatile ("lock; xaddl %0, %1" :
+                "+r" (inc), "+m" (*addr) : : "memory", "cc");
+  return inc;
+}
+
+// Atomically set *addr to newval if it equals oldval.  Returns the
+// value *addr held before, which is oldval on success.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+  uint32_t result;
+
+  asm volatile ("lock; cmpxchgl %2, %1" :
+                "=a" (result), "+m" (*addr) :
+                "r" (newval), "0" (oldval) :
+                "memory", "cc");
+  return result;
+}
+
 #endif /* !JOS_INC_X86_H */
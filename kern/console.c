@@ -8,6 +8,9 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+
+struct spinlock cons_lock = SPINLOCK_INIT(cons_lock, LOCK_RANK_CONS, SPIN_TICKET);
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -410,8 +413,9 @@ cons_intr(int (*proc)(void))
 int
 cons_getc(void)
 {
-  int c;
+  int c = 0;
 
+  spin_lock(&cons_lock);
   // poll for any pending input characters,
   // so that this function works even when interrupts are disabled
   // (e.g., when called from the kernel monitor).
@@ -423,9 +427,9 @@ cons_getc(void)
     c = cons.buf[cons.rpos++];
     if (cons.rpos == CONSBUFSIZE)
       cons.rpos = 0;
-    return c;
   }
-  return 0;
+  spin_unlock(&cons_lock);
+  return c;
 }
 
 // output a character to the console
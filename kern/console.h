@@ -17,6 +17,9 @@
 #define CRT_COLS        80
 #define CRT_SIZE        (CRT_ROWS * CRT_COLS)
 
+// Serializes console input and output between CPUs.
+extern struct spinlock cons_lock;
+
 void cons_init(void);
 int cons_getc(void);
 
@@ -6,10 +6,14 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
 
+// Maximum number of spinlocks one CPU may hold at once
+#define CPU_MAXLOCKS  8
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
@@ -17,12 +21,69 @@ enum {
 	CPU_HALTED,
 };
 
+// Per-CPU queue of ENV_RUNNABLE environments.  Most policies link
+// envs in FIFO order through env_rq_next/env_rq_prev, one list per
+// MLFQ level (only level 0 is used outside SCHED_MLFQ); SCHED_CFS and
+// SCHED_STRIDE keep them in rq_tree ordered by virtual time instead.
+// Protected by sched_lock.
+struct RunQueue {
+	struct Env *rq_head[MLFQ_LEVELS];       // Next env to run
+	struct Env *rq_tail[MLFQ_LEVELS];       // Most recently enqueued env
+	struct rb_tree rq_tree;         // Envs keyed by virtual time
+	uint64_t rq_min_key;            // Monotonic floor for rq_tree keys
+	int rq_len;                     // Number of envs on the queue
+
+	// Real-time envs reserved on this CPU.  They are never stolen
+	// and always run ahead of the best-effort envs above.
+	struct rb_tree rq_rt_tree;      // Ready envs keyed by deadline
+	struct Env *rq_rt_list;         // All envs reserved on this CPU
+	int rq_rt_util;                 // Reserved share, of RT_UTIL_ONE
+};
+
+// Per-CPU magazine of free pages in front of the global page free
+// list.  page_alloc and page_free use it without taking page_lock,
+// and reuse the pages this CPU freed most recently while they are
+// still in its cache; they move MAG_BATCH pages at a time to or from
+// the global list when it runs empty or full.  pm_lock is taken by
+// its own CPU on every use, so it is uncontended except when another
+// CPU, out of memory, empties the magazine (see kern/pmap.c).
+// pm_zero holds up to MAG_ZERO pages already zeroed for ALLOC_ZERO,
+// taken from the global zero pool a batch at a time.
+#define MAG_SIZE   32
+#define MAG_BATCH  16
+#define MAG_ZERO   8
+
+struct PageMagazine {
+	struct spinlock pm_lock;        // Protects the page arrays and counts
+	struct PageInfo *pm_pages[MAG_SIZE];    // Most recently freed last
+	int pm_count;
+	struct PageInfo *pm_zero[MAG_ZERO];     // Zeroed free pages
+	int pm_nzero;
+	uint32_t pm_allocs;             // Pages allocated on this CPU
+	uint32_t pm_frees;              // Pages freed on this CPU
+	uint32_t pm_refills;            // Batches taken from the free list
+	uint32_t pm_drains;             // Batches returned to the free list
+	uint32_t pm_zero_hits;          // ALLOC_ZERO served from the zero pool
+	uint32_t pm_zero_misses;        // ALLOC_ZERO that had to clear a page
+	uint32_t pm_zeroed;             // Pages this CPU zeroed while idle
+};
+
 // Per-CPU state
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct RunQueue cpu_runq;       // Runnable envs waiting for this CPU
+	bool cpu_tickless;              // Running with the timer stopped
+	volatile bool cpu_kicked;       // Sent a reschedule IPI while halted
+	bool cpu_sched_dirty;           // Took sched_lock since env_run
+	struct Env *cpu_zombie;         // Dying env switched away from, to free
+	struct spinlock *cpu_locks[CPU_MAXLOCKS]; // Locks held (SPINLOCK_CHECK)
+	int cpu_nlocks;
+	struct mcs_node cpu_mcs[CPU_MAXLOCKS];  // Queue nodes for SPIN_MCS locks
+	uint32_t cpu_mcs_used;          // Bit i set if cpu_mcs[i] is in use
+	struct PageMagazine cpu_pages;  // Free pages cached on this CPU
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +103,13 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_oneshot(uint32_t count);
+uint32_t lapic_timer_count(void);
+uint32_t lapic_timer_cycles(uint64_t tsc);
+
+// Measured at boot against the PIT
+extern uint64_t tsc_hz;             // TSC cycles per second
+extern uint32_t lapic_timer_hz;     // LAPIC timer cycles per second
 
 #endif
@@ -12,17 +12,18 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/time.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 
 struct Env *envs = NULL;                // All environments
 static struct Env *env_free_list;       // Free environment list
-                                        // (linked by Env->env_link)
+                                        // (linked by Env->env_link,
+                                        // protected by sched_lock)
+static struct spinlock env_locks[NENV]; // Per-env locks, by ENVX
 
 #define ENVGENSHIFT     12              // >= LOGNENV
 
-struct Env* ticker;
-
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -74,6 +75,10 @@ struct Pseudodesc gdt_pd = {
 //   On success, sets *env_store to the environment.
 //   On error, sets *env_store to NULL.
 //
+// The answer stays true only while the caller holds sched_lock (which
+// is enough to work on the env's scheduling state) or the env's lock;
+// see envid2env_lock().
+//
 int
 envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 {
@@ -110,6 +115,70 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
   return 0;
 }
 
+// Like envid2env, but also lock the env, which keeps it from being
+// freed until the caller calls env_unlock().  Fails with -E_BAD_ENV
+// if the env is being destroyed.
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+  struct Env *e;
+
+  if (envid2env(envid, &e, checkperm) < 0) {
+    *env_store = NULL;
+    return -E_BAD_ENV;
+  }
+  env_lock(e);
+  if (!env_valid(e, envid)) {
+    env_unlock(e);
+    *env_store = NULL;
+    return -E_BAD_ENV;
+  }
+  *env_store = e;
+  return 0;
+}
+
+// Check that e, which envid2env() returned for envid and whose lock
+// the caller now holds, is still that env and is not being destroyed.
+bool
+env_valid(struct Env *e, envid_t envid)
+{
+  return e->env_status != ENV_FREE && e->env_status != ENV_DYING &&
+    (envid == 0 || e->env_id == envid);
+}
+
+void
+env_lock(struct Env *e)
+{
+  spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+  spin_unlock(&env_locks[e - envs]);
+}
+
+// Lock two envs, which may be the same, in envs[] order.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+  if (a > b)
+    env_lock_pair(b, a);
+  else {
+    env_lock(a);
+    if (b != a)
+      env_lock(b);
+  }
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+  env_unlock(a);
+  if (b != a)
+    env_unlock(b);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -131,6 +200,8 @@ env_init(void)
     temp = temp->env_link;
     temp->env_id = 0;
   }
+  for(i=0; i<NENV; i++)
+    __spin_initlock(&env_locks[i], "env_lock", LOCK_RANK_ENV, SPIN_TICKET);
 
   // Per-CPU part of the initialization
   env_init_percpu();
@@ -195,7 +266,7 @@ env_setup_vm(struct Env *e)
   //    - The functions in kern/pmap.h are handy.
 
   // LAB 3: Your code here.
-  p->pp_ref++;
+  page_incref(p);
   e->env_pgdir = (pde_t*)page2kva(p);
   for(i=PDX(UTOP);i<NPDENTRIES;i++){
     e->env_pgdir[i] = kern_pgdir[i];
@@ -212,6 +283,8 @@ env_setup_vm(struct Env *e)
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// It is left ENV_NOT_RUNNABLE for the caller to finish setting up.
+// Call with sched_lock held.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
@@ -238,8 +311,32 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
   // Set the basic status variables.
   e->env_parent_id = parent_id;
   e->env_type = ENV_TYPE_USER;
-  e->env_status = ENV_RUNNABLE;
   e->env_runs = 0;
+  e->env_affinity = ENV_AFFINITY_ALL;
+  e->env_gang = 0;
+  e->estRunTime = 0;
+  e->env_cputime = 0;
+  e->env_systime = 0;
+  e->env_waittime = 0;
+  e->env_nvcsw = 0;
+  e->env_nivcsw = 0;
+  e->env_start_nsec = time_nsec();
+  e->env_first_nsec = 0;
+  e->env_preempted = 0;
+  e->env_vruntime = 0;
+  e->env_weight = ENV_WEIGHT_DEFAULT;
+  e->env_pass = 0;
+  e->env_tickets = ENV_TICKETS_DEFAULT;
+  e->env_tickets_lent = 0;
+  e->env_donee = 0;
+  e->env_ipc_to = 0;
+  e->env_mlfq_level = 0;
+  e->env_mlfq_ticks = 0;
+  e->env_mlfq_epoch = 0;
+  e->env_rt_period = 0;
+  e->env_rt_jobs = 0;
+  e->env_rt_misses = 0;
+  env_set_status(e, ENV_NOT_RUNNABLE);
 
   // Clear out all the saved register state,
   // to prevent the register values
@@ -394,7 +491,7 @@ load_icode(struct Env *e, uint8_t *binary)
 // Allocates a new env with env_alloc, loads the named elf
 // binary into it with load_icode, and sets its env_type.
 // This function is ONLY called during kernel initialization,
-// before running the first user-mode environment.
+// before running the first user-mode environment, with sched_lock held.
 // The new env's parent ID is set to 0.
 //
 void
@@ -408,10 +505,13 @@ env_create(uint8_t *binary, enum EnvType type)
   env->env_type = type;
 
   load_icode(env,binary);
+  env_set_status(env, ENV_RUNNABLE);
 }
 
 //
 // Frees env e and all memory it uses.
+// e must be ENV_DYING, so that no CPU will start running it, and the
+// caller must hold e's lock.
 //
 void
 env_free(struct Env *e)
@@ -437,6 +537,12 @@ env_free(struct Env *e)
     if (!(e->env_pgdir[pdeno] & PTE_P))
       continue;
 
+    // a 4MB page has no page table to free
+    if (e->env_pgdir[pdeno] & PTE_PS) {
+      page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+      continue;
+    }
+
     // find the pa and va of the page table
     pa = PTE_ADDR(e->env_pgdir[pdeno]);
     pt = (pte_t*)KADDR(pa);
@@ -456,14 +562,40 @@ env_free(struct Env *e)
   e->env_pgdir = 0;
   page_decref(pa2page(pa));
 
+  // return any lent or borrowed scheduling tickets and real-time
+  // reservation
+  lock_sched();
+  sched_revoke(e);
+  sched_revoke_to(e);
+  sched_rt_reserve(e, 0, 0);
+
   // return the environment to the free list
-  e->env_status = ENV_FREE;
+  env_set_status(e, ENV_FREE);
   e->env_link = env_free_list;
   env_free_list = e;
+  unlock_sched();
 }
 
 //
-// Frees environment e.
+// Free the dying env that this CPU last switched away from, if any
+// (see sched_switch).  Call with no locks held.
+//
+void
+env_reap(void)
+{
+  struct Env *e = thiscpu->cpu_zombie;
+
+  if (!e)
+    return;
+  thiscpu->cpu_zombie = NULL;
+  env_lock(e);
+  env_free(e);
+  env_unlock(e);
+}
+
+//
+// Frees environment e.  The caller must hold e's lock, which is
+// released.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -471,21 +603,55 @@ void
 env_destroy(struct Env *e)
 {
   // If e is currently running on other CPUs, we change its state to
-  // ENV_DYING. A zombie environment will be freed the next time
-  // it traps to the kernel.
-  if (e->env_status == ENV_RUNNING && curenv != e) {
-    e->env_status = ENV_DYING;
+  // ENV_DYING and interrupt its CPU. A zombie environment will be
+  // freed the next time it traps to the kernel, or by its CPU once
+  // it switches away (env_reap).  An env that is already dying is
+  // being freed by someone else.
+  lock_sched();
+  if (curenv != e &&
+      (e->env_status == ENV_RUNNING || e->env_status == ENV_DYING)) {
+    if (e->env_status == ENV_RUNNING) {
+      env_set_status(e, ENV_DYING);
+      sched_evict(e);
+    }
+    unlock_sched();
+    env_unlock(e);
     return;
   }
 
+  // Take e off the run queues first, so no other CPU can start it.
+  env_set_status(e, ENV_DYING);
+  unlock_sched();
   env_free(e);
+  env_unlock(e);
 
   if (curenv == e) {
     curenv = NULL;
+    lock_sched();
     sched_yield();
   }
 }
 
+//
+// Sets e's env_status, keeping the scheduler's run queues in sync.
+// All transitions into or out of ENV_RUNNABLE must go through here
+// so that exactly the runnable envs are queued.  An env that leaves
+// ENV_NOT_RUNNABLE by any route no longer sleeps (see sys_sleep).
+// A dying env stays dying until env_free.  Call with sched_lock held.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+  if (e->env_status == ENV_DYING && status != ENV_FREE)
+    return;
+  if (e->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+    sched_dequeue(e);
+  if (e->env_status == ENV_NOT_RUNNABLE && status != ENV_NOT_RUNNABLE)
+    sched_sleep_cancel(e);
+  e->env_status = status;
+  if (status == ENV_RUNNABLE)
+    sched_enqueue(e);
+}
 
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
@@ -512,6 +678,7 @@ env_pop_tf(struct Trapframe *tf)
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// Call with sched_lock held; it is released before entering e.
 //
 // This function does not return.
 //
@@ -536,18 +703,37 @@ env_run(struct Env *e)
   //	e->env_tf to sensible values.
 
   // LAB 3: Your code here.
-  if(curenv != NULL){
-    curenv->env_status = ENV_RUNNABLE;
+  sched_switch(curenv, e);
+  if(curenv != NULL && curenv != e && curenv->env_status == ENV_RUNNING){
+    env_set_status(curenv, ENV_RUNNABLE);
   }
-  if(e->env_type == ENV_TYPE_TIME)
-    ticker = e;  
   curenv = e;
-  e->env_status = ENV_RUNNING;
+  env_set_status(e, ENV_RUNNING);
   e->env_runs++;
   lcr3(PADDR(e->env_pgdir));
-  unlock_kernel();
+  sched_timer_arm();
+  thiscpu->cpu_sched_dirty = 0;
+  unlock_sched();
+  e->env_tsc_in = read_tsc();
   env_pop_tf(&(e->env_tf));
 
   panic("env_run not yet implemented");
 }
 
+//
+// Return to curenv, which is still ENV_RUNNING, from a trap that took
+// no scheduling decision and did not take sched_lock: its status, run
+// queue and timer are as env_run() left them, so none of that work
+// (nor the lock) is needed.
+//
+// This function does not return.
+//
+void
+env_resume(void)
+{
+  sched_switch(curenv, curenv);
+  curenv->env_runs++;
+  curenv->env_tsc_in = read_tsc();
+  env_pop_tf(&curenv->env_tf);
+}
+
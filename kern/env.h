@@ -14,12 +14,23 @@ void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
+void	env_reap(void);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_status(struct Env *e, unsigned status);
+
+// Per-env locks (see kern/spinlock.h for the lock order)
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *a, struct Env *b);
+void	env_unlock_pair(struct Env *a, struct Env *b);
+bool	env_valid(struct Env *e, envid_t envid);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
-// The following two functions do not return
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+// The following three functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
+void	env_resume(void) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
 // Without this extra macro, we couldn't pass macros like TEST to
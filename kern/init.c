@@ -7,7 +7,9 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
+#include <kern/time.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
@@ -16,6 +18,7 @@
 #include <kern/spinlock.h>
 
 static void boot_aps(void);
+static const char *boot_cmdline(void);
 
 
 void
@@ -32,6 +35,9 @@ i386_init(void)
   // Can't call cprintf until after we do this!
   cons_init();
 
+  // Read boot options before mem_init can reuse the memory they are in.
+  sched_init(boot_cmdline());
+
   int x = 1, y = 3, z = 4;
   cprintf("x %d, y %x, z %d\n", x, y, z);
   cprintf("6828 decimal is %o octal!\n", 6828);
@@ -41,6 +47,7 @@ i386_init(void)
 
   // Lab 2 memory management initialization functions
   mem_init();
+  kmalloc_init();
 
   // Lab 3 user environment initialization functions
   env_init();
@@ -49,18 +56,17 @@ i386_init(void)
   // Lab 4 multiprocessor initialization functions
   mp_init();
   lapic_init();
+  time_init();
 
   // Lab 4 multitasking initialization functions
   pic_init();
 
-  // Acquire the big kernel lock before waking up APs
-  // Your code here:
-  lock_kernel();
+  // Hold sched_lock while waking up APs and creating the first
+  // envs, so that no AP schedules before they exist.
+  lock_sched();
 
   // Starting non-boot CPUs
   boot_aps();
-  
-  ENV_CREATE(user_hello, ENV_TYPE_TIME);
 
 #if defined(TEST)
   // Don't touch -- used by grading script!
@@ -74,6 +80,45 @@ i386_init(void)
   sched_yield();
 }
 
+// Multiboot information, as left by the boot loader (kern/entry.S).
+#define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
+#define MULTIBOOT_INFO_CMDLINE          0x00000004
+
+struct multiboot_info {
+  uint32_t flags;
+  uint32_t mem_lower;
+  uint32_t mem_upper;
+  uint32_t boot_device;
+  uint32_t cmdline;             // Physical address of a C string
+};
+
+extern uint32_t multiboot_magic, multiboot_info;
+
+// Longest kernel command line kept, including the terminating NUL
+#define CMDLINE_MAX     256
+
+// Return the kernel command line from a multiboot loader such as
+// QEMU's -kernel/-append, or NULL if the kernel was started some other
+// way (e.g. by boot/main.c).  The line is copied, truncated to
+// CMDLINE_MAX - 1 characters, and the copy never reads past the low
+// 4MB of physical memory, the only part mapped this early.
+static const char *
+boot_cmdline(void)
+{
+  static char buf[CMDLINE_MAX];
+  struct multiboot_info *mbi;
+
+  if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC ||
+      multiboot_info >= PTSIZE - sizeof(*mbi))
+    return NULL;
+  mbi = (struct multiboot_info *) (multiboot_info + KERNBASE);
+  if (!(mbi->flags & MULTIBOOT_INFO_CMDLINE) || mbi->cmdline >= PTSIZE)
+    return NULL;
+  strlcpy(buf, (const char *) (mbi->cmdline + KERNBASE),
+          MIN(sizeof(buf), PTSIZE - mbi->cmdline));
+  return buf;
+}
+
 // While boot_aps is booting a given CPU, it communicates the per-core
 // stack pointer that should be loaded by mpentry.S to that CPU in
 // this variable.
@@ -110,7 +155,9 @@ boot_aps(void)
 void
 mp_main(void)
 {
-  // We are in high EIP now, safe to switch to kern_pgdir
+  // We are in high EIP now, safe to switch to kern_pgdir, which
+  // needs page size extensions on (see mem_init)
+  lcr4(rcr4() | CR4_PSE);
   lcr3(PADDR(kern_pgdir));
   cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -124,7 +171,7 @@ mp_main(void)
   // only one CPU can enter the scheduler at a time!
   //
   // Your code here:
-  lock_kernel();
+  lock_sched();
   sched_yield();
 }
 
@@ -0,0 +1,503 @@
+// Slab allocator for kernel objects.
+//
+// A KmemCache hands out objects of one size.  It carves them out of
+// slabs: naturally aligned blocks of 1 << kc_order pages from the buddy
+// allocator, each starting with a struct KmemSlab that heads a list of
+// its free objects.  Every page of a slab points back at the slab
+// through pp_slab, so an object can be freed without knowing its size.
+// A cache keeps its slabs on three lists by how many of their objects
+// are in use, allocates from partly used slabs first so that the rest
+// can empty out, and returns empty slabs to the page allocator, except
+// for one that it keeps so as not to free and reallocate a slab when
+// a single object comes and goes.
+//
+// In front of the slabs, each CPU caches up to KMEM_CPU_SIZE free
+// objects of each cache.  Allocation and free only take the cache's
+// kc_lock to move KMEM_CPU_BATCH objects at a time between a CPU's
+// cache and the slabs, and a CPU reuses the objects it freed most
+// recently while they are still in its data cache.
+//
+// kmalloc and kfree sit on top of a set of caches of power-of-two
+// sizes and pass larger requests straight to page_alloc_order.
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_CPU_SIZE   16      // Objects each CPU caches per cache
+#define KMEM_CPU_BATCH  8       // Objects moved to or from the slabs at once
+#define KMEM_MAX_ORDER  3       // Largest slab, as a page_alloc_order order
+#define KMEM_LINE       64      // Cache line size
+
+// Free objects one CPU holds for a cache.  Only that CPU touches it.
+struct KmemCpu {
+  void *cc_objs[KMEM_CPU_SIZE];         // Most recently freed last
+  int cc_count;
+  uint32_t cc_allocs;           // Objects allocated on this CPU
+  uint32_t cc_frees;            // Objects freed on this CPU
+  uint32_t cc_refills;          // Batches taken from the slabs
+  uint32_t cc_drains;           // Batches returned to the slabs
+};
+
+struct KmemSlab {
+  struct KmemSlab *sl_next;
+  struct KmemSlab *sl_prev;
+  struct KmemCache *sl_cache;
+  void *sl_free;                // Free objects, linked at kc_link
+  int sl_inuse;                 // Objects not on sl_free
+};
+
+struct KmemCache {
+  const char *kc_name;
+  size_t kc_size;               // Distance between objects in a slab
+  size_t kc_link;               // Offset of the free list link in an object
+  size_t kc_offset;             // Offset of the first object in a slab
+  int kc_order;                 // Slabs are PGSIZE << kc_order bytes
+  int kc_perslab;               // Objects per slab
+  void (*kc_ctor)(void *obj);
+
+  struct spinlock kc_lock;      // Protects the slabs and the counts below
+  struct KmemSlab *kc_partial;  // Slabs with some objects in use
+  struct KmemSlab *kc_full;     // Slabs with every object in use
+  struct KmemSlab *kc_empty;    // A slab with no objects in use, or NULL
+  uint32_t kc_slabs;            // Slabs allocated
+  uint32_t kc_inuse;            // Objects out of the slabs, counting
+                                // those in the per-CPU caches
+  uint32_t kc_grows;            // Slabs ever allocated
+  uint32_t kc_shrinks;          // Slabs ever freed
+
+  struct KmemCpu kc_cpu[NCPU];
+  struct KmemCache *kc_next;    // Next on kmem_caches
+};
+
+// Free list link of the free object obj.
+#define OBJ_LINK(c, obj)  (*(void **) ((char *) (obj) + (c)->kc_link))
+
+// All caches, newest first, for slabinfo.  Protected by kmem_lock.
+static struct KmemCache *kmem_caches;
+static struct spinlock kmem_lock = SPINLOCK_INIT(kmem_lock, LOCK_RANK_KMEM, SPIN_TICKET);
+
+static struct KmemCache kmalloc_caches[] = {
+  { .kc_name = "kmalloc-16" },
+  { .kc_name = "kmalloc-32" },
+  { .kc_name = "kmalloc-64" },
+  { .kc_name = "kmalloc-128" },
+  { .kc_name = "kmalloc-256" },
+  { .kc_name = "kmalloc-512" },
+  { .kc_name = "kmalloc-1024" },
+  { .kc_name = "kmalloc-2048" },
+};
+#define NKMALLOC  (sizeof(kmalloc_caches) / sizeof(kmalloc_caches[0]))
+
+static void kmalloc_check(void);
+
+static void
+kmem_cache_init(struct KmemCache *c, const char *name, size_t size,
+                size_t align, void (*ctor)(void *obj))
+{
+  size_t slab, waste;
+  int order, n;
+
+  if (align == 0)
+    for (align = sizeof(void *); align < KMEM_LINE && align < size; )
+      align <<= 1;
+  if ((align & (align - 1)) != 0 || align > PGSIZE)
+    panic("kmem_cache_create: %s: bad alignment %u", name, align);
+
+  memset(c, 0, sizeof(*c));
+  c->kc_name = name;
+  c->kc_ctor = ctor;
+  __spin_initlock(&c->kc_lock, (char *) name, LOCK_RANK_KMEM, SPIN_TICKET);
+
+  // A free object's first word links it into its slab's free list,
+  // unless a constructor has set up the object: then the link goes
+  // after it, so that it does not overwrite constructed state.
+  c->kc_link = ctor ? ROUNDUP(size, sizeof(void *)) : 0;
+  c->kc_size = ROUNDUP(MAX(size, c->kc_link + sizeof(void *)), align);
+  c->kc_offset = ROUNDUP(sizeof(struct KmemSlab), align);
+
+  // Use the smallest slab that wastes no more than an eighth of itself.
+  for (order = 0; ; order++) {
+    slab = PGSIZE << order;
+    n = slab > c->kc_offset ? (slab - c->kc_offset) / c->kc_size : 0;
+    waste = slab - c->kc_offset - n * c->kc_size;
+    if (order == KMEM_MAX_ORDER || (n > 0 && waste <= slab / 8))
+      break;
+  }
+  if (n == 0)
+    panic("kmem_cache_create: %s: %u-byte objects are too large",
+          name, size);
+  c->kc_order = order;
+  c->kc_perslab = n;
+
+  spin_lock(&kmem_lock);
+  c->kc_next = kmem_caches;
+  kmem_caches = c;
+  spin_unlock(&kmem_lock);
+}
+
+//
+// Set up the kmalloc caches.  Call after mem_init.
+//
+void
+kmalloc_init(void)
+{
+  int i;
+
+  for (i = 0; i < NKMALLOC; i++)
+    kmem_cache_init(&kmalloc_caches[i], kmalloc_caches[i].kc_name,
+                    KMALLOC_MIN << i, 0, NULL);
+  kmalloc_check();
+}
+
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+                  void (*ctor)(void *obj))
+{
+  struct KmemCache *c;
+
+  if (!(c = kmalloc(sizeof(*c))))
+    return NULL;
+  kmem_cache_init(c, name, size, align, ctor);
+  return c;
+}
+
+// The slab list that s belongs on, going by how many of its objects
+// are in use.
+static struct KmemSlab **
+slab_list(struct KmemCache *c, struct KmemSlab *s)
+{
+  return s->sl_inuse == c->kc_perslab ? &c->kc_full : &c->kc_partial;
+}
+
+static void
+slab_list_add(struct KmemSlab **list, struct KmemSlab *s)
+{
+  s->sl_prev = NULL;
+  s->sl_next = *list;
+  if (*list)
+    (*list)->sl_prev = s;
+  *list = s;
+}
+
+static void
+slab_list_remove(struct KmemSlab **list, struct KmemSlab *s)
+{
+  if (s->sl_prev)
+    s->sl_prev->sl_next = s->sl_next;
+  else
+    *list = s->sl_next;
+  if (s->sl_next)
+    s->sl_next->sl_prev = s->sl_prev;
+}
+
+// Allocate a new slab for c, with every object free and constructed.
+// It is on none of c's lists.  Call with kc_lock held.
+static struct KmemSlab *
+slab_grow(struct KmemCache *c)
+{
+  struct PageInfo *pp;
+  struct KmemSlab *s;
+  char *obj;
+  int i;
+
+  if (!(pp = page_alloc_order(c->kc_order, 0)))
+    return NULL;
+  s = page2kva(pp);
+  s->sl_cache = c;
+  s->sl_inuse = 0;
+  s->sl_free = NULL;
+  for (i = c->kc_perslab - 1; i >= 0; i--) {
+    obj = (char *) s + c->kc_offset + i * c->kc_size;
+    if (c->kc_ctor)
+      c->kc_ctor(obj);
+    OBJ_LINK(c, obj) = s->sl_free;
+    s->sl_free = obj;
+  }
+  for (i = 0; i < (1 << c->kc_order); i++)
+    pp[i].pp_slab = s;
+  c->kc_slabs++;
+  c->kc_grows++;
+  return s;
+}
+
+// Return the empty slab s to the page allocator.  Call with kc_lock held.
+static void
+slab_release(struct KmemCache *c, struct KmemSlab *s)
+{
+  struct PageInfo *pp = pa2page(PADDR(s));
+  int i;
+
+  for (i = 0; i < (1 << c->kc_order); i++)
+    pp[i].pp_slab = NULL;
+  page_free_order(pp, c->kc_order);
+  c->kc_slabs--;
+  c->kc_shrinks++;
+}
+
+// Take a free object from c's slabs, or return NULL if out of memory.
+// Call with kc_lock held.
+static void *
+slab_get(struct KmemCache *c)
+{
+  struct KmemSlab *s;
+  void *obj;
+
+  if (!(s = c->kc_partial)) {
+    if (!(s = c->kc_empty) && !(s = slab_grow(c)))
+      return NULL;
+    c->kc_empty = NULL;
+    slab_list_add(&c->kc_partial, s);
+  }
+  obj = s->sl_free;
+  s->sl_free = OBJ_LINK(c, obj);
+  if (++s->sl_inuse == c->kc_perslab) {
+    slab_list_remove(&c->kc_partial, s);
+    slab_list_add(&c->kc_full, s);
+  }
+  c->kc_inuse++;
+  return obj;
+}
+
+// Return obj to its slab.  Call with kc_lock held.
+static void
+slab_put(struct KmemCache *c, void *obj)
+{
+  struct KmemSlab *s = pa2page(PADDR(obj))->pp_slab;
+
+  slab_list_remove(slab_list(c, s), s);
+  OBJ_LINK(c, obj) = s->sl_free;
+  s->sl_free = obj;
+  s->sl_inuse--;
+  c->kc_inuse--;
+  if (s->sl_inuse > 0)
+    slab_list_add(&c->kc_partial, s);
+  else if (!c->kc_empty)
+    c->kc_empty = s;
+  else
+    slab_release(c, s);
+}
+
+//
+// Allocate an object from c.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *c)
+{
+  struct KmemCpu *cc = &c->kc_cpu[cpunum()];
+  void *obj;
+
+  if (cc->cc_count == 0) {
+    spin_lock(&c->kc_lock);
+    while (cc->cc_count < KMEM_CPU_BATCH && (obj = slab_get(c)))
+      cc->cc_objs[cc->cc_count++] = obj;
+    spin_unlock(&c->kc_lock);
+    if (cc->cc_count == 0)
+      return NULL;
+    cc->cc_refills++;
+  }
+  cc->cc_allocs++;
+  return cc->cc_objs[--cc->cc_count];
+}
+
+//
+// Free obj, which must have come from kmem_cache_alloc(c).
+//
+void
+kmem_cache_free(struct KmemCache *c, void *obj)
+{
+  struct KmemCpu *cc = &c->kc_cpu[cpunum()];
+  struct KmemSlab *s = pa2page(PADDR(obj))->pp_slab;
+  int i;
+
+  if (!s || s->sl_cache != c ||
+      ((char *) obj - (char *) s - c->kc_offset) % c->kc_size != 0)
+    panic("kmem_cache_free: %p is not a %s object", obj, c->kc_name);
+
+  if (cc->cc_count == KMEM_CPU_SIZE) {
+    spin_lock(&c->kc_lock);
+    for (i = 0; i < KMEM_CPU_BATCH; i++)
+      slab_put(c, cc->cc_objs[i]);
+    spin_unlock(&c->kc_lock);
+    memmove(cc->cc_objs, cc->cc_objs + KMEM_CPU_BATCH,
+            (KMEM_CPU_SIZE - KMEM_CPU_BATCH) * sizeof(cc->cc_objs[0]));
+    cc->cc_count -= KMEM_CPU_BATCH;
+    cc->cc_drains++;
+  }
+  cc->cc_frees++;
+  cc->cc_objs[cc->cc_count++] = obj;
+}
+
+//
+// Destroy c, which must have come from kmem_cache_create.  Every object
+// must have been freed, and no CPU may use c any more.
+//
+void
+kmem_cache_destroy(struct KmemCache *c)
+{
+  struct KmemCache **cp;
+  struct KmemCpu *cc;
+  int i;
+
+  spin_lock(&c->kc_lock);
+  for (i = 0; i < ncpu; i++) {
+    cc = &c->kc_cpu[i];
+    while (cc->cc_count > 0)
+      slab_put(c, cc->cc_objs[--cc->cc_count]);
+  }
+  if (c->kc_inuse != 0)
+    panic("kmem_cache_destroy: %s: %u objects in use",
+          c->kc_name, c->kc_inuse);
+  if (c->kc_empty)
+    slab_release(c, c->kc_empty);
+  c->kc_empty = NULL;
+  spin_unlock(&c->kc_lock);
+
+  spin_lock(&kmem_lock);
+  for (cp = &kmem_caches; *cp != c; cp = &(*cp)->kc_next)
+    /* do nothing */;
+  *cp = c->kc_next;
+  spin_unlock(&kmem_lock);
+  kfree(c);
+}
+
+//
+// Allocate size bytes of kernel memory, aligned to the cache line size
+// or to the smallest power of two at least size, whichever is smaller;
+// blocks larger than KMALLOC_MAX are page aligned.  The memory is not
+// zeroed.  Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size)
+{
+  struct PageInfo *pp;
+  int i;
+
+  if (size <= KMALLOC_MAX) {
+    for (i = 0; (KMALLOC_MIN << i) < size; i++)
+      /* do nothing */;
+    return kmem_cache_alloc(&kmalloc_caches[i]);
+  }
+  for (i = 0; i <= PAGE_MAX_ORDER && (PGSIZE << i) < size; i++)
+    /* do nothing */;
+  if (i > PAGE_MAX_ORDER || !(pp = page_alloc_order(i, 0)))
+    return NULL;
+  return page2kva(pp);
+}
+
+//
+// Free memory from kmalloc, or any kmem_cache_alloc.  p may be NULL.
+//
+void
+kfree(void *p)
+{
+  struct PageInfo *pp;
+
+  if (!p)
+    return;
+  pp = pa2page(PADDR(p));
+  if (pp->pp_slab)
+    kmem_cache_free(pp->pp_slab->sl_cache, p);
+  else if (PGOFF(p) == 0)
+    page_free_order(pp, pp->pp_order);
+  else
+    panic("kfree: %p was not allocated with kmalloc", p);
+}
+
+//
+// Print each cache's size, slabs and objects, and how often its
+// per-CPU caches had to go to the slabs.
+//
+void
+slabinfo(void)
+{
+  struct KmemCache *c;
+  uint32_t slabs, inuse, cached, allocs, refills, drains;
+  int i;
+
+  cprintf("cache          objsize order/objs  slabs  active   total"
+          "   cached    allocs  refills   drains\n");
+  // kmem_lock keeps the caches from going away under us.  The counts
+  // are only a snapshot, so read them without kc_lock, which would
+  // nest under kmem_lock at the same rank.
+  spin_lock(&kmem_lock);
+  for (c = kmem_caches; c; c = c->kc_next) {
+    slabs = c->kc_slabs;
+    inuse = c->kc_inuse;
+    cached = allocs = refills = drains = 0;
+    for (i = 0; i < ncpu; i++) {
+      cached += c->kc_cpu[i].cc_count;
+      allocs += c->kc_cpu[i].cc_allocs;
+      refills += c->kc_cpu[i].cc_refills;
+      drains += c->kc_cpu[i].cc_drains;
+    }
+    cprintf("%-16s %5u %3d/%-4d %6u %7u %7u %8u %9u %8u %8u\n",
+            c->kc_name, c->kc_size, c->kc_order, c->kc_perslab, slabs,
+            inuse - cached, slabs * c->kc_perslab, cached, allocs,
+            refills, drains);
+  }
+  spin_unlock(&kmem_lock);
+}
+
+static int ctor_calls;
+
+static void
+check_ctor(void *obj)
+{
+  *(uint32_t *) obj = 0xfeedface;
+  ctor_calls++;
+}
+
+static void
+kmalloc_check(void)
+{
+  static void *objs[256];
+  struct KmemCache *c;
+  size_t size;
+  void *p;
+  int i;
+
+  // Each size class hands out distinct, suitably aligned objects that
+  // can be written in full and come back after being freed.
+  for (size = 1; size <= KMALLOC_MAX; size *= 2) {
+    for (i = 0; i < 256; i++) {
+      assert((objs[i] = kmalloc(size)));
+      assert((uint32_t) objs[i] % MIN(size, KMEM_LINE) == 0);
+      memset(objs[i], i, size);
+    }
+    for (i = 0; i < 256; i++)
+      assert(*((uint8_t *) objs[i] + size - 1) == (uint8_t) i);
+    for (i = 0; i < 256; i++)
+      kfree(objs[i]);
+  }
+
+  // Large blocks come straight from the page allocator.
+  assert((p = kmalloc(3 * PGSIZE)) && PGOFF(p) == 0);
+  assert(pa2page(PADDR(p))->pp_order == 2);
+  memset(p, 0, 3 * PGSIZE);
+  kfree(p);
+
+  // Objects are constructed once per slab, not once per allocation,
+  // and keep their state across a free and a reallocation.
+  assert((c = kmem_cache_create("kmalloc_check", 24, 0, check_ctor)));
+  assert((p = kmem_cache_alloc(c)));
+  assert(*(uint32_t *) p == 0xfeedface);
+  assert(ctor_calls == c->kc_perslab);
+  kmem_cache_free(c, p);
+  assert(kmem_cache_alloc(c) == p && *(uint32_t *) p == 0xfeedface);
+  assert(ctor_calls == c->kc_perslab);
+  kmem_cache_free(c, p);
+
+  // Destroying the cache gives back its slab and takes it off the list.
+  kmem_cache_destroy(c);
+  assert(pa2page(PADDR(p))->pp_slab == NULL);
+  for (c = kmem_caches; c; c = c->kc_next)
+    assert(strcmp(c->kc_name, "kmalloc_check") != 0);
+
+  cprintf("kmalloc_check() succeeded!\n");
+}
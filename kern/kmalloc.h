@@ -0,0 +1,36 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// kmalloc serves sizes up to KMALLOC_MAX from caches of power-of-two
+// sized objects, the smallest KMALLOC_MIN bytes, and larger sizes with
+// whole blocks of pages from page_alloc_order.
+#define KMALLOC_MIN     16
+#define KMALLOC_MAX     2048
+
+struct KmemCache;
+
+void kmalloc_init(void);
+void *kmalloc(size_t size);
+void kfree(void *p);
+
+// A cache of objects of one size and type.  align is a power of two,
+// or 0 for the cache line size (or the object size rounded up to a
+// power of two, for objects smaller than a cache line).  If ctor is
+// not NULL it constructs each object once, when its slab is created;
+// objects must be freed back to the cache in their constructed state.
+struct KmemCache *kmem_cache_create(const char *name, size_t size,
+                                    size_t align, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct KmemCache *c);
+void kmem_cache_free(struct KmemCache *c, void *obj);
+void kmem_cache_destroy(struct KmemCache *c);
+
+void slabinfo(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
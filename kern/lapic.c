@@ -32,6 +32,7 @@
 #define ICRHI   (0x0310/4)            // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)            // Local Vector Table 0 (TIMER)
         #define X1         0x0000000B // divide counts by 1
+        #define ONESHOT    0x00000000 // One-shot
         #define PERIODIC   0x00020000 // Periodic
 #define PCINT   (0x0340/4)            // Performance Counter LVT
 #define LINT0   (0x0350/4)            // Local Vector Table 1 (LINT0)
@@ -45,6 +46,21 @@
 physaddr_t lapicaddr;                 // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Measured by lapic_calibrate()
+uint64_t tsc_hz;                      // TSC frequency
+uint32_t lapic_timer_hz;              // LAPIC timer frequency (at X1)
+
+// 8253/8254 programmable interval timer, channel 2, whose gate and
+// output are wired to the keyboard controller's port B.
+#define PIT_HZ          1193182
+#define IO_PIT_CH2      0x42
+#define IO_PIT_CMD      0x43
+#define IO_PORTB        0x61
+        #define PORTB_GATE2     0x01  // Channel 2 gate
+        #define PORTB_SPKR      0x02  // Speaker enable
+        #define PORTB_OUT2      0x20  // Channel 2 output
+#define CALIBRATE_MS    10
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +68,40 @@ lapicw(int index, int value)
   lapic[ID];        // wait for write to finish, by reading
 }
 
+// Measure the TSC and LAPIC timer frequencies by counting both over
+// CALIBRATE_MS milliseconds of PIT channel 2, which runs at a fixed,
+// known rate.
+static void
+lapic_calibrate(void)
+{
+  uint32_t latch = PIT_HZ * CALIBRATE_MS / 1000;
+  uint64_t tsc0, tsc1;
+  uint32_t tccr;
+
+  lapicw(TIMER, MASKED);
+
+  // Channel 2 in mode 0 (interrupt on terminal count): OUT2 goes
+  // high once latch PIT cycles have elapsed.
+  outb(IO_PORTB, (inb(IO_PORTB) & ~PORTB_SPKR) | PORTB_GATE2);
+  outb(IO_PIT_CMD, 0xB0);       // channel 2, lobyte/hibyte, mode 0
+  outb(IO_PIT_CH2, latch & 0xFF);
+  outb(IO_PIT_CH2, latch >> 8);
+  // Count the LAPIC timer down from the maximum alongside; it won't
+  // reach 0 in CALIBRATE_MS.
+  tsc0 = read_tsc();
+  lapicw(TICR, 0xFFFFFFFF);
+  while (!(inb(IO_PORTB) & PORTB_OUT2))
+    ;
+  tccr = lapic[TCCR];
+  tsc1 = read_tsc();
+  lapicw(TICR, 0);
+
+  tsc_hz = (tsc1 - tsc0) * 1000 / CALIBRATE_MS;
+  lapic_timer_hz = (uint64_t)(0xFFFFFFFF - tccr) * 1000 / CALIBRATE_MS;
+  cprintf("LAPIC: timer %u kHz, TSC %u kHz\n",
+          lapic_timer_hz / 1000, (uint32_t)(tsc_hz / 1000));
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +115,16 @@ lapic_init(void)
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If we cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // The timer counts down once at bus frequency from lapic[TICR]
+  // and then issues an interrupt.  It starts out stopped; the
+  // scheduler arms it with lapic_timer_oneshot() when it next needs
+  // to make a decision.  All CPUs share the bus clock, so the boot
+  // CPU measures its frequency for everyone.
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  if (thiscpu == bootcpu)
+    lapic_calibrate();
+  lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+  lapicw(TICR, 0);
 
   // Leave LINT0 of the BSP enabled so that it can get
   // interrupts from the 8259A chip.
@@ -127,6 +180,39 @@ lapic_eoi(void)
     lapicw(EOI, 0);
 }
 
+// Interrupt this CPU once, after count timer cycles, replacing any
+// earlier setting.  A count of 0 stops the timer.
+void
+lapic_timer_oneshot(uint32_t count)
+{
+  if (lapic)
+    lapicw(TICR, count);
+}
+
+// Convert a duration in TSC cycles to LAPIC timer cycles, saturating
+// at the timer's 32-bit range.
+uint32_t
+lapic_timer_cycles(uint64_t tsc)
+{
+  uint64_t t;
+
+  if (!lapic)
+    return 0;
+  if (tsc >= tsc_hz)
+    tsc = tsc_hz;       // Longer than a second; one second will do
+  t = tsc * (lapic_timer_hz / 1000) / (tsc_hz / 1000);
+  return t > 0xFFFFFFFF ? 0xFFFFFFFF : t;
+}
+
+// Timer cycles left before the timer fires, or 0 if it is stopped.
+uint32_t
+lapic_timer_count(void)
+{
+  if (lapic)
+    return lapic[TCCR];
+  return 0;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 static void
@@ -180,3 +266,14 @@ lapic_ipi(int vector)
   while (lapic[ICRLO] & DELIVS)
     ;
 }
+
+// Send an interrupt with the given vector to the CPU whose local
+// APIC ID is apicid.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+  lapicw(ICRHI, apicid << 24);
+  lapicw(ICRLO, FIXED | vector);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+}
@@ -12,7 +12,10 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE 80 // enough for one VGA text line
 
@@ -33,6 +36,10 @@ static struct Command commands[] = {
   { "dumprng",   "dumprng -p -v add1 add2",              mon_dumprng    },
   { "continue",  "Continue execution from breakpoint",   mon_continue   },
   { "step",      "step to next instruction",             mon_step       },
+  { "lockstat",  "Lock contention stats: lockstat [reset]", mon_lockstat },
+  { "pages",     "Show free pages and per-CPU page caches", mon_pages   },
+  { "buddyinfo", "Show free blocks and fragmentation by order", mon_buddyinfo },
+  { "slabinfo",  "Show kmem caches and their per-CPU caches", mon_slabinfo },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -61,6 +68,8 @@ mon_infokern(int argc, char **argv, struct Trapframe *tf)
   cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
   cprintf("Kernel executable memory footprint: %dKB\n",
           ROUNDUP(end - entry, 1024) / 1024);
+  cprintf("Clocks: TSC %u kHz, LAPIC timer %u kHz\n",
+          (uint32_t)(tsc_hz / 1000), lapic_timer_hz / 1000);
   return 0;
 }
 
@@ -103,6 +112,7 @@ mon_smappings(int argc, char **argv, struct Trapframe *tf)
       if(*pte&PTE_P) strcat(perm,"PTE_P ");
       if(*pte&PTE_U) strcat(perm,"PTE_U ");
       if(*pte&PTE_W) strcat(perm,"PTE_W ");
+      if(*pte&PTE_PS) strcat(perm,"PTE_PS ");
       cprintf("0x%08x:      0x%08x             %s\n",va,PTE_ADDR(*pte),perm);
     }
   }
@@ -126,6 +136,8 @@ mon_eperm(int argc, char **argv, struct Trapframe *tf)
     cprintf("No Directory Entry Made\n",va);
   else if(pte==0){
     cprintf("No Page Table Entry\n",va);
+  }else if(*pte & PTE_PS){
+    cprintf("0x%08x is in a 4MB page, not changing it\n",va);
   }else{
     for(i=2; i < argc; i++){
       if(argv[i][4] == 'P') perm = perm|PTE_P;
@@ -192,6 +204,43 @@ mon_step(int argc, char **argv, struct Trapframe *tf)
   return 0;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef SPINLOCK_STATS
+  if (argc == 2 && strcmp(argv[1], "reset") == 0)
+    lockstat_reset();
+  else if (argc == 1)
+    lockstat_print();
+  else
+    cprintf("Usage: lockstat [reset]\n");
+#else
+  cprintf("Lock statistics are disabled (SPINLOCK_STATS)\n");
+#endif
+  return 0;
+}
+
+int
+mon_pages(int argc, char **argv, struct Trapframe *tf)
+{
+  num_free_pages();
+  return 0;
+}
+
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+  page_buddyinfo();
+  return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+  slabinfo();
+  return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
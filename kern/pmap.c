@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;                          // Amount of physical memory (in pages)
@@ -18,7 +19,29 @@ static size_t npages_basemem;           // Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;                      // Kernel's initial page directory
 struct PageInfo *pages;                 // Physical page state array
-static struct PageInfo *page_free_list; // Free list of physical pages
+
+// Buddy allocator free lists, one per order (see buddy_alloc)
+static struct PageInfo *free_area[PAGE_MAX_ORDER + 1];
+static size_t free_blocks[PAGE_MAX_ORDER + 1];  // Length of each list
+
+// Whether page_alloc and page_free go through the per-CPU magazines
+// (struct PageMagazine).  Off until mem_init's checks are done, as
+// they expect to be able to take every free page.
+static bool page_mags_on;
+
+// Free pages zeroed ahead of time, so that page_alloc(ALLOC_ZERO)
+// rarely has to clear a page while its caller waits.  Idle CPUs
+// refill the pool from sched_halt (page_zero_idle), and page_alloc
+// takes MAG_ZERO pages at a time from it into the caller's magazine.
+// Linked through pp_link.
+#define ZERO_POOL_MAX   256     // Most pages kept zeroed
+#define ZERO_BATCH      32      // Most pages zeroed per idle period
+static struct PageInfo *zero_pool;
+static size_t zero_count;
+
+// Protects the buddy free lists, the zero pool and the pp_ref of
+// every page.
+static struct spinlock page_lock = SPINLOCK_INIT(page_lock, LOCK_RANK_PAGE, SPIN_TICKET);
 
 
 // --------------------------------------------------------------
@@ -67,6 +90,14 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_large_page(void);
+static void page_table_remove(pde_t *pgdir, void *va);
+static struct PageInfo *buddy_alloc(int order);
+static void buddy_free(struct PageInfo *pp, int order);
+static struct PageInfo *mag_alloc(struct PageMagazine *m);
+static bool mag_reclaim(void);
+static struct PageInfo *zero_alloc(struct PageMagazine *m);
+static void mag_free(struct PageMagazine *m, struct PageInfo *pp);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -79,7 +110,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -229,12 +260,10 @@ mem_init(void)
   // we just set up the mapping anyway.
   // Permissions: kernel RW, user NONE
   // Your code goes here:
-  for (i = 0; i < npages * PGSIZE; i += PGSIZE){
-    page_insert(kern_pgdir, pa2page(i), (void*)(KERNBASE+i), PTE_P|PTE_W);
-  }for(i = i; i < 0x100000000 - KERNBASE; i+=PGSIZE){
-    if(kern_pgdir[PDX(KERNBASE+i)] == 0)
-      kern_pgdir[PDX(KERNBASE+i)]= PTE_P|PTE_W;
-  }
+  // Use 4MB pages, so the mapping needs no page tables and a handful
+  // of TLB entries covers all of the kernel's memory.
+  for (i = 0; i < 0x100000000 - KERNBASE; i += PTSIZE)
+    kern_pgdir[PDX(KERNBASE+i)] = i|PTE_PS|PTE_P|PTE_W;
 
   // Initialize the SMP-related parts of the memory map
   mem_init_mp();
@@ -248,7 +277,9 @@ mem_init(void)
   // mapped the same way by both page tables.
   //
   // If the machine reboots at this point, you've probably set up your
-  // kern_pgdir wrong.
+  // kern_pgdir wrong.  It maps KERNBASE with 4MB pages, which need
+  // page size extensions on.
+  lcr4(rcr4() | CR4_PSE);
   lcr3(PADDR(kern_pgdir));
 
   check_page_free_list(0);
@@ -262,6 +293,12 @@ mem_init(void)
 
   // Some more checks, only possible after kern_pgdir is installed.
   check_page_installed_pgdir();
+  check_large_page();
+
+  for(i = 0; i < NCPU; i++)
+    __spin_initlock(&cpus[i].cpu_pages.pm_lock, "pm_lock",
+                    LOCK_RANK_MAG, SPIN_TICKET);
+  page_mags_on = 1;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -308,7 +345,7 @@ mem_init_mp(void)
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -335,25 +372,127 @@ page_init(void)
       // NB: DO NOT actually touch the physical memory corresponding to
       // free pages!
   size_t i;
-  pages[0].pp_ref = 1;
-  pages[0].pp_link = NULL;
-  for (i = 1; i < npages_basemem; i++) {
-    if(&pages[i]!=pa2page(MPENTRY_PADDR)){
+  struct PageInfo *free = pa2page(PADDR(boot_alloc(0)));
+
+  for (i = 0; i < npages; i++) {
+    pages[i].pp_link = pages[i].pp_prev = NULL;
+    pages[i].pp_free = pages[i].pp_order = 0;
+    if (i == 0 || &pages[i] == pa2page(MPENTRY_PADDR) ||
+        (i >= npages_basemem && &pages[i] < free))
+      pages[i].pp_ref = 1;
+    else
       pages[i].pp_ref = 0;
-      pages[i].pp_link = page_free_list;
-      page_free_list = &pages[i];
-    }
   }
-  struct PageInfo * free = pa2page(PADDR(boot_alloc(0)));
-  for (i = i; &pages[i] < free; i++){
-    pages[i].pp_ref = 1;
-    pages[i].pp_link = NULL;
+
+  // Free from the top down: buddy_free merges each page with the
+  // higher pages already freed, and leaves the lowest block of each
+  // order at the head of its list.  Until mem_init switches to
+  // kern_pgdir only low memory is mapped, and buddy_alloc takes the
+  // head of the smallest order that has a block, so the page tables
+  // mem_init allocates come from low memory.
+  for (i = npages; i-- > 0; )
+    if (pages[i].pp_ref == 0)
+      buddy_free(&pages[i], 0);
+}
+
+//
+// The physical page allocator is a binary buddy allocator.  Free
+// memory is kept as blocks of 1 << order pages, for orders 0 to
+// PAGE_MAX_ORDER, each aligned to its size.  Each block's first page
+// is on free_area[order], a doubly linked list through pp_link and
+// pp_prev, with pp_free set and pp_order holding the order.  A block's
+// buddy is the other half of the block twice its size; freeing a
+// block whose buddy is also free merges the two, repeatedly, so free
+// memory stays in the largest blocks possible.
+//
+// All of this is protected by page_lock.  Single pages mostly go
+// through the per-CPU magazines (struct PageMagazine) instead.
+//
+
+// Add the free block pp of the given order to its free list.
+static void
+free_area_add(struct PageInfo *pp, int order)
+{
+  pp->pp_free = 1;
+  pp->pp_order = order;
+  pp->pp_prev = NULL;
+  pp->pp_link = free_area[order];
+  if (pp->pp_link)
+    pp->pp_link->pp_prev = pp;
+  free_area[order] = pp;
+  free_blocks[order]++;
+}
+
+// Take the free block pp off its free list.
+static void
+free_area_remove(struct PageInfo *pp)
+{
+  int order = pp->pp_order;
+
+  if (pp->pp_prev)
+    pp->pp_prev->pp_link = pp->pp_link;
+  else
+    free_area[order] = pp->pp_link;
+  if (pp->pp_link)
+    pp->pp_link->pp_prev = pp->pp_prev;
+  pp->pp_link = pp->pp_prev = NULL;
+  pp->pp_free = 0;
+  free_blocks[order]--;
+}
+
+// Allocate a block of 1 << order pages, splitting a larger block if
+// there is no free block of that order.  The lower half of a split
+// block is kept, the upper half freed.  Returns NULL if no block is
+// large enough.  Call with page_lock held.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+  struct PageInfo *pp;
+  int o;
+
+  for (o = order; o <= PAGE_MAX_ORDER && !free_area[o]; o++)
+    /* do nothing */;
+  if (o > PAGE_MAX_ORDER)
+    return NULL;
+  pp = free_area[o];
+  free_area_remove(pp);
+  while (o > order) {
+    o--;
+    free_area_add(pp + (1 << o), o);
   }
-  for (free = free; free < &pages[npages]; free+=sizeof(struct PageInfo)){
-    free->pp_ref = 0;
-    free->pp_link = page_free_list;
-    page_free_list = free;
+  pp->pp_order = order;
+  return pp;
+}
+
+// Free the block of 1 << order pages at pp, merging it with its buddy
+// for as long as the buddy is free too.  Call with page_lock held.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+  size_t i = pp - pages, buddy;
+
+  for (; order < PAGE_MAX_ORDER; order++) {
+    buddy = i ^ (1 << order);
+    if (buddy >= npages || !pages[buddy].pp_free ||
+        pages[buddy].pp_order != order)
+      break;
+    free_area_remove(&pages[buddy]);
+    i &= ~(size_t) (1 << order);
   }
+  free_area_add(&pages[i], order);
+}
+
+// Number of free pages on the buddy free lists.  Call with page_lock
+// held.
+static size_t
+buddy_nfree(void)
+{
+  size_t nfree = 0;
+  int o;
+
+  for (o = 0; o <= PAGE_MAX_ORDER; o++)
+    nfree += free_blocks[o] << o;
+  return nfree;
 }
 
 //
@@ -371,29 +510,289 @@ page_init(void)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-  struct PageInfo *page = page_free_list;
-  if(page==NULL){
+  struct PageMagazine *m = &thiscpu->cpu_pages;
+  struct PageInfo *page = NULL;
+
+  if(alloc_flags & ALLOC_ZERO){
+    if((page = zero_alloc(m))){
+      m->pm_zero_hits++;
+      alloc_flags &= ~ALLOC_ZERO;
+    }else
+      m->pm_zero_misses++;
+  }
+  if(page == NULL){
+    if(page_mags_on){
+      // Pages may be sitting in other CPUs' magazines.
+      if(!(page = mag_alloc(m)) && mag_reclaim())
+        page = mag_alloc(m);
+    }else{
+      spin_lock(&page_lock);
+      page = buddy_alloc(0);
+      spin_unlock(&page_lock);
+    }
+  }
+  // Out of memory: the zeroed pages are free pages too.
+  if(page == NULL && (page = zero_alloc(m)))
+    alloc_flags &= ~ALLOC_ZERO;
+  if(page==NULL)
     return NULL;
-  }else if(alloc_flags & ALLOC_ZERO){
-    page_free_list = page->pp_link;
-    page->pp_link = NULL;
+  page->pp_link = NULL;
+  page->pp_ref = 0;
+
+  if(alloc_flags & ALLOC_ZERO)
     memset(page2kva(page), 0, PGSIZE);
-    return page;
-  }else{
-    page_free_list = page->pp_link;
-    page->pp_link = NULL;
-    page->pp_ref = 0;
-    return page;
+  return page;
+}
+
+//
+// Allocates 1 << order physically contiguous pages, aligned to their
+// size, and returns the PageInfo of the first.  alloc_flags is as for
+// page_alloc, and ALLOC_ZERO zeroes the whole block.  The pages'
+// reference counts are 0; the block is freed as a whole with
+// page_free_order.
+//
+// Returns NULL if order is out of range or there is no free block that
+// large.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+  struct PageInfo *page;
+  int i;
+
+  if(order == 0)
+    return page_alloc(alloc_flags);
+  if(order < 0 || order > PAGE_MAX_ORDER)
+    return NULL;
+
+  spin_lock(&page_lock);
+  page = buddy_alloc(order);
+  spin_unlock(&page_lock);
+  // The magazines' pages may be what keeps free blocks from merging.
+  if(page == NULL && page_mags_on && mag_reclaim()){
+    spin_lock(&page_lock);
+    page = buddy_alloc(order);
+    spin_unlock(&page_lock);
+  }
+  if(page==NULL)
+    return NULL;
+  for(i = 0; i < (1 << order); i++)
+    page[i].pp_ref = 0;
+
+  if(alloc_flags & ALLOC_ZERO)
+    memset(page2kva(page), 0, PGSIZE << order);
+  return page;
+}
+
+// Take a zeroed page from this CPU's magazine m, first refilling it
+// with up to MAG_ZERO pages from the zero pool if it is empty.
+// Returns NULL if both are empty.  Call with m == &thiscpu->cpu_pages.
+static struct PageInfo *
+zero_alloc(struct PageMagazine *m)
+{
+  struct PageInfo *pp = NULL;
+
+  if(!page_mags_on)
+    return NULL;
+  spin_lock(&m->pm_lock);
+  // Don't take page_lock just to find the pool empty.
+  if(m->pm_nzero == 0 && zero_pool){
+    spin_lock(&page_lock);
+    while(m->pm_nzero < MAG_ZERO && (pp = zero_pool)){
+      zero_pool = pp->pp_link;
+      zero_count--;
+      m->pm_zero[m->pm_nzero++] = pp;
+    }
+    spin_unlock(&page_lock);
   }
+  pp = m->pm_nzero ? m->pm_zero[--m->pm_nzero] : NULL;
+  spin_unlock(&m->pm_lock);
+  return pp;
 }
 
+//
+// Called by a CPU with nothing to run, from sched_halt: zero free
+// pages into the zero pool until the pool is full, ZERO_BATCH pages
+// are done, another CPU gives this one work (cpu_kicked), or the
+// timer sched_halt armed has expired.  Interrupts are off throughout,
+// so checking between pages delays the timer interrupt by at most
+// one page's worth of zeroing.
+//
+void
+page_zero_idle(void)
+{
+  struct CpuInfo *c = thiscpu;
+  struct PageInfo *pp;
+  bool armed = lapic_timer_count() != 0;
+  int i;
+
+  for(i = 0; i < ZERO_BATCH && zero_count < ZERO_POOL_MAX &&
+        !c->cpu_kicked && !(armed && lapic_timer_count() == 0); i++){
+    if(!(pp = page_alloc(0)))
+      break;
+    memset(page2kva(pp), 0, PGSIZE);
+    c->cpu_pages.pm_zeroed++;
+    spin_lock(&page_lock);
+    pp->pp_link = zero_pool;
+    zero_pool = pp;
+    zero_count++;
+    spin_unlock(&page_lock);
+  }
+}
+
+// Print the number of free pages, and the contents and counters of
+// each CPU's page magazine and of the zero pool.
 void
 num_free_pages(void){
-  struct PageInfo* pp;
-  int nfree;
-  for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-    ++nfree;
-  cprintf("num free:%d\n",nfree);
+  struct PageMagazine *m;
+  int nfree, nzero, i;
+  spin_lock(&page_lock);
+  nfree = buddy_nfree();
+  nzero = zero_count;
+  spin_unlock(&page_lock);
+  for (i = 0; i < ncpu; i++) {
+    nfree += cpus[i].cpu_pages.pm_count;
+    nzero += cpus[i].cpu_pages.pm_nzero;
+  }
+  nfree += nzero;
+  cprintf("num free:%d (%d zeroed)\n",nfree,nzero);
+  for (i = 0; i < ncpu; i++) {
+    m = &cpus[i].cpu_pages;
+    cprintf("  CPU %d: %2d cached, %d zeroed, %u allocs, %u frees, "
+            "%u refills, %u drains\n", i, m->pm_count, m->pm_nzero,
+            m->pm_allocs, m->pm_frees, m->pm_refills, m->pm_drains);
+    cprintf("         zero pool: %u hits, %u misses, %u pages zeroed\n",
+            m->pm_zero_hits, m->pm_zero_misses, m->pm_zeroed);
+  }
+}
+
+// Print the buddy allocator's free blocks of each order and how
+// fragmented free memory is.  For each order, "unusable" is the
+// share of free memory that is in smaller blocks and so cannot serve
+// an allocation of that order.  Pages in the per-CPU magazines and
+// the zero pool count as unusable at every order above 0.
+void
+page_buddyinfo(void)
+{
+  size_t blocks[PAGE_MAX_ORDER + 1];
+  size_t nfree, ncached, below;
+  int o, i;
+
+  spin_lock(&page_lock);
+  for (o = 0; o <= PAGE_MAX_ORDER; o++)
+    blocks[o] = free_blocks[o];
+  ncached = zero_count;
+  spin_unlock(&page_lock);
+  for (i = 0; i < ncpu; i++)
+    ncached += cpus[i].cpu_pages.pm_count + cpus[i].cpu_pages.pm_nzero;
+  nfree = ncached;
+  for (o = 0; o <= PAGE_MAX_ORDER; o++)
+    nfree += blocks[o] << o;
+
+  cprintf("order  block  free blocks  free pages  unusable\n");
+  below = ncached;
+  for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+    cprintf("%5d %5dK %12u %11u %8u%%\n", o, 4 << o, blocks[o],
+            blocks[o] << o, o && nfree ? below * 100 / nfree : 0);
+    below += blocks[o] << o;
+  }
+  cprintf("%u free pages, %u of them in per-CPU magazines "
+          "or the zero pool\n", nfree, ncached);
+}
+
+// Take a page from this CPU's magazine m, first refilling it with a
+// batch of single pages from the buddy allocator if it is empty.
+// Returns NULL if both are empty.  Call with m == &thiscpu->cpu_pages.
+static struct PageInfo *
+mag_alloc(struct PageMagazine *m)
+{
+  struct PageInfo *pp;
+
+  spin_lock(&m->pm_lock);
+  if(m->pm_count == 0){
+    spin_lock(&page_lock);
+    while(m->pm_count < MAG_BATCH && (pp = buddy_alloc(0)))
+      m->pm_pages[m->pm_count++] = pp;
+    spin_unlock(&page_lock);
+    if(m->pm_count == 0){
+      spin_unlock(&m->pm_lock);
+      return NULL;
+    }
+    m->pm_refills++;
+  }
+  m->pm_allocs++;
+  pp = m->pm_pages[--m->pm_count];
+  spin_unlock(&m->pm_lock);
+  return pp;
+}
+
+// Put pp in this CPU's magazine m, first returning its MAG_BATCH
+// least recently freed pages to the buddy allocator if it is full.
+static void
+mag_free(struct PageMagazine *m, struct PageInfo *pp)
+{
+  int i;
+
+  spin_lock(&m->pm_lock);
+  if(m->pm_count == MAG_SIZE){
+    spin_lock(&page_lock);
+    for(i = 0; i < MAG_BATCH; i++)
+      buddy_free(m->pm_pages[i], 0);
+    spin_unlock(&page_lock);
+    memmove(m->pm_pages, m->pm_pages + MAG_BATCH,
+            (MAG_SIZE - MAG_BATCH) * sizeof(m->pm_pages[0]));
+    m->pm_count -= MAG_BATCH;
+    m->pm_drains++;
+  }
+  m->pm_frees++;
+  m->pm_pages[m->pm_count++] = pp;
+  spin_unlock(&m->pm_lock);
+}
+
+// Out of memory: return every page in every CPU's magazine to the
+// buddy allocator, and its zeroed pages to the zero pool, where any
+// CPU can take them.  Returns whether any page was returned.
+static bool
+mag_reclaim(void)
+{
+  struct PageMagazine *m;
+  struct PageInfo *pp;
+  bool found = 0;
+  int i;
+
+  for(i = 0; i < ncpu; i++){
+    m = &cpus[i].cpu_pages;
+    if(m->pm_count == 0 && m->pm_nzero == 0)
+      continue;
+    spin_lock(&m->pm_lock);
+    if(m->pm_count > 0 || m->pm_nzero > 0){
+      spin_lock(&page_lock);
+      while(m->pm_count > 0)
+        buddy_free(m->pm_pages[--m->pm_count], 0);
+      while(m->pm_nzero > 0){
+        pp = m->pm_zero[--m->pm_nzero];
+        pp->pp_link = zero_pool;
+        zero_pool = pp;
+        zero_count++;
+      }
+      spin_unlock(&page_lock);
+      m->pm_drains++;
+      found = 1;
+    }
+    spin_unlock(&m->pm_lock);
+  }
+  return found;
+}
+
+// Panic if the block at pp cannot be freed.
+static void
+page_free_check(struct PageInfo *pp)
+{
+  if(pp->pp_ref != 0){
+    panic("Still references to this page, can't return to free list");
+  }else if(pp->pp_link != NULL || pp->pp_free){
+    panic("pp_link is not NULL");
+  }
 }
 
 //
@@ -406,27 +805,61 @@ page_free(struct PageInfo *pp)
   // Fill this function in
   // Hint: You may want to panic if pp->pp_ref is nonzero or
   // pp->pp_link is not NULL.
-  if(pp->pp_ref != 0){
-    panic("Still references to this page, can't return to free list");
-  }else if(pp->pp_link != NULL){
-    panic("pp_link is not NULL");
-  }else if(page_free_list == NULL){
-    page_free_list = pp;
-  }else{
-    pp->pp_link = page_free_list;
-    page_free_list = pp;
+  page_free_check(pp);
+  if(page_mags_on){
+    mag_free(&thiscpu->cpu_pages, pp);
+    return;
   }
+  spin_lock(&page_lock);
+  buddy_free(pp, 0);
+  spin_unlock(&page_lock);
+}
+
+//
+// Return a block allocated with page_alloc_order(order, ...).
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+  if(order == 0){
+    page_free(pp);
+    return;
+  }
+  page_free_check(pp);
+  if(pp->pp_order != order)
+    panic("page_free_order: block is order %d, not %d",
+          pp->pp_order, order);
+  spin_lock(&page_lock);
+  buddy_free(pp, order);
+  spin_unlock(&page_lock);
 }
 
 //
 // Decrement the reference count on a page,
-// freeing it if there are no more refs.
+// freeing it if there are no more refs.  A page at the head of a
+// block from page_alloc_order frees the whole block.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-  if (--pp->pp_ref == 0)
-    page_free(pp);
+  uint16_t ref;
+
+  spin_lock(&page_lock);
+  ref = --pp->pp_ref;
+  spin_unlock(&page_lock);
+  if (ref == 0)
+    page_free_order(pp, pp->pp_order);
+}
+
+//
+// Increment the reference count on a page.
+//
+void
+page_incref(struct PageInfo* pp)
+{
+  spin_lock(&page_lock);
+  pp->pp_ref++;
+  spin_unlock(&page_lock);
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -441,6 +874,9 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If 'va' is in a 4MB page (PTE_PS), there is no page table: the PDE
+// maps the page, and pgdir_walk returns a pointer to the PDE.
+//
 // Hint 1: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -468,10 +904,12 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
       else perm=PTE_P|PTE_U|PTE_W;
       pde = (pde_t)(page2pa(page)|(perm));
       pgdir[PDX(va)] = pde;
-      page->pp_ref++;
+      page_incref(page);
       pte = KADDR(PTE_ADDR(pde));
       return (pte_t*)&pte[PTX(va)];
     }
+  }else if(pgdir[PDX(va)] & PTE_PS){
+    return &pgdir[PDX(va)];
   }else{
     pte = KADDR(PTE_ADDR(pgdir[PDX(va)]));
     return (pte_t*)&pte[PTX(va)];
@@ -518,9 +956,15 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// If perm includes PTE_PS, pp must head a block of 1 << PAGE_LARGE_ORDER
+// pages, and it is mapped as one 4MB page at va, which must be
+// PTSIZE-aligned.  This replaces everything mapped in the 4MB at va.
+// A 4K page cannot be mapped inside a 4MB page.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va is inside a 4MB page and perm lacks PTE_PS
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -528,22 +972,29 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
-  pte_t* pte = pgdir_walk(pgdir, va, 1);
-  if(pte == NULL) return -E_NO_MEM;
-  
-  if(*pte != 0){
-    if(PTE_ADDR(*pte) == page2pa(pp)){
-      pp->pp_ref--;
-    }else{
-      page_remove(pgdir, va);
-    }
+  pte_t* pte;
+
+  if(perm & PTE_PS){
+    assert(PGOFF(va) == 0 && PTX(va) == 0);
+    pte = &pgdir[PDX(va)];
+  }else{
+    if(pgdir[PDX(va)] & PTE_PS)
+      return -E_INVAL;
+    pte = pgdir_walk(pgdir, va, 1);
+    if(pte == NULL) return -E_NO_MEM;
   }
-  
+
+  // Take the new reference before dropping the old mapping, so that
+  // re-inserting the page already mapped at va cannot free it.
+  page_incref(pp);
+  if((perm & PTE_PS) && *pte != 0 && !(*pte & PTE_PS))
+    page_table_remove(pgdir, va);
+  else if(*pte != 0)
+    page_remove(pgdir, va);
+
   *pte = page2pa(pp) | (perm|PTE_P);
-  pp->pp_ref++;
   tlb_invalidate(pgdir,va);
   return 0;
-  
 }
 
 //
@@ -555,6 +1006,9 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va is in a 4MB page, return the block's first page, and store a
+// pointer to the PDE (which has PTE_PS set).
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -581,6 +1035,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
 //
+// If va is in a 4MB page, the whole 4MB page is unmapped.
+//
 // Hint: The TA solution is implemented using page_lookup,
 //  tlb_invalidate, and page_decref.
 //
@@ -590,6 +1046,13 @@ page_remove(pde_t *pgdir, void *va)
   pde_t* pt;
   struct PageInfo* page;
   if(pgdir[PDX(va)] == 0) return;
+  if(pgdir[PDX(va)] & PTE_PS){
+    page = pa2page(PTE_ADDR(pgdir[PDX(va)]));
+    pgdir[PDX(va)] = 0;
+    page_decref(page);
+    tlb_invalidate(pgdir, ROUNDDOWN(va, PTSIZE));
+    return;
+  }
   pt = KADDR(PTE_ADDR(pgdir[PDX(va)]));
   if(pt[PTX(va)] == 0) return;
   page = pa2page(PTE_ADDR(pt[PTX(va)]));
@@ -599,6 +1062,25 @@ page_remove(pde_t *pgdir, void *va)
   tlb_invalidate(pgdir, va);
 }
 
+//
+// Unmap every page in the page table for the 4MB at va, and free the
+// page table.
+//
+static void
+page_table_remove(pde_t *pgdir, void *va)
+{
+  physaddr_t pa = PTE_ADDR(pgdir[PDX(va)]);
+  pte_t *pt = KADDR(pa);
+  int i;
+
+  for(i = 0; i < NPTENTRIES; i++)
+    if(pt[i] != 0)
+      page_remove(pgdir, PGADDR(PDX(va), i, 0));
+  pgdir[PDX(va)] = 0;
+  page_decref(pa2page(pa));
+  tlb_invalidate(pgdir, va);
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -655,7 +1137,8 @@ static uintptr_t user_mem_check_addr;
 
 //
 // Check that an environment is allowed to access the range of memory
-// [va, va+len) with permissions 'perm | PTE_P'.
+// [va, va+len) with permissions 'perm | PTE_P'.  Every one of those
+// bits must be set, in the PDE and the PTE (or the PDE of a 4MB page).
 // Normally 'perm' will contain PTE_U at least, but this is not required.
 // 'va' and 'len' need not be page-aligned; you must test every page that
 // contains any of that range.  You will test either 'len/PGSIZE',
@@ -690,7 +1173,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
       break;
     }
     pde = &pgdir[PDX(va+i)];
-    if(!(*pde&(perm|PTE_P))){
+    if((*pde&(perm|PTE_P)) != (perm|PTE_P)){
       allowed = false;
       if(va+i==va)
 	user_mem_check_addr = (uintptr_t)va+i;
@@ -698,8 +1181,11 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	user_mem_check_addr = (uintptr_t)ROUNDDOWN(va+i,PGSIZE);
       break;
     }
+    // A 4MB page has no page table; its PDE has the permissions.
+    if(*pde & PTE_PS)
+      continue;
     pte = &(((pte_t*)KADDR(PTE_ADDR(*pde)))[PTX(va+i)]);
-    if(!(*pte&(perm|PTE_P))){
+    if((*pte&(perm|PTE_P)) != (perm|PTE_P)){
       allowed= false;
       if(va+i==va)
 	user_mem_check_addr = (uintptr_t)va+i;
@@ -717,20 +1203,21 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	user_mem_check_addr = (uintptr_t)ROUNDDOWN(va+len-1,PGSIZE);
     }
     pde = &pgdir[PDX(va+len-1)];
-    if(!(*pde&(perm|PTE_P))){
+    if((*pde&(perm|PTE_P)) != (perm|PTE_P)){
       allowed = false;
       if(va+i==va)
 	user_mem_check_addr = (uintptr_t)va+len-1;
       else
 	user_mem_check_addr = (uintptr_t)ROUNDDOWN(va+len-1,PGSIZE);
-    }
-    pte = &(((pte_t*)KADDR(PTE_ADDR(*pde)))[PTX(va+len-1)]);
-    if(!(*pte&(perm|PTE_P))){
-      allowed= false;
-      if(va+i==va)
-	user_mem_check_addr = (uintptr_t)va+len-1;
-      else
-	user_mem_check_addr = (uintptr_t)ROUNDDOWN(va+len-1,PGSIZE);
+    }else if(!(*pde & PTE_PS)){
+      pte = &(((pte_t*)KADDR(PTE_ADDR(*pde)))[PTX(va+len-1)]);
+      if((*pte&(perm|PTE_P)) != (perm|PTE_P)){
+	allowed= false;
+	if(va+i==va)
+	  user_mem_check_addr = (uintptr_t)va+len-1;
+	else
+	  user_mem_check_addr = (uintptr_t)ROUNDDOWN(va+len-1,PGSIZE);
+      }
     }
   }
   
@@ -748,11 +1235,27 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
+  if (user_mem_lock(env, va, len, perm) == 0)
+    env_unlock(env);
+}
+
+//
+// Like user_mem_assert, but on success returns 0 with env's lock held,
+// so that the range stays mapped while the kernel uses it; the caller
+// releases it with env_unlock().  Returns -E_FAULT, without the lock,
+// if env was destroyed and is not the current environment.
+//
+int
+user_mem_lock(struct Env *env, const void *va, size_t len, int perm)
+{
+  env_lock(env);
   if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
     cprintf("[%08x] user_mem_check assertion failure for "
             "va %08x\n", env->env_id, user_mem_check_addr);
     env_destroy(env);                   // may not return
+    return -E_FAULT;
   }
+  return 0;
 }
 
 
@@ -761,69 +1264,85 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the buddy free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-  struct PageInfo *pp;
+  struct PageInfo *head, *pp;
   unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
   int nfree_basemem = 0, nfree_extmem = 0;
   char *first_free_page;
+  int o, j;
 
-  if (!page_free_list)
-    panic("'page_free_list' is a null pointer!");
-
-  if (only_low_memory) {
-    // Move pages with lower addresses first in the free
-    // list, since entry_pgdir does not map all pages.
-    struct PageInfo *pp1, *pp2;
-    struct PageInfo **tp[2] = { &pp1, &pp2 };
-    for (pp = page_free_list; pp; pp = pp->pp_link) {
-      int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-      *tp[pagetype] = pp;
-      tp[pagetype] = &pp->pp_link;
-    }
-    *tp[1] = 0;
-    *tp[0] = pp2;
-    page_free_list = pp1;
-  }
-
-  // if there's a page that shouldn't be on the free list,
-  // try to make sure it eventually causes trouble.
-  for (pp = page_free_list; pp; pp = pp->pp_link){
-    if (PDX(page2pa(pp)) < pdx_limit) {
-      //cprintf("Page index: %d add: %08x",PGNUM(page2pa(pp)),page2pa(pp));
-      memset(page2kva(pp), 0x97, 128);
-    }
-  }
+  if (!buddy_nfree())
+    panic("the page free lists are empty!");
 
   first_free_page = (char*)boot_alloc(0);
-  for (pp = page_free_list; pp; pp = pp->pp_link) {
-    // check that we didn't corrupt the free list itself
-    assert(pp >= pages);
-    assert(pp < pages + npages);
-    assert(((char*)pp - (char*)pages) % sizeof(*pp) == 0);
-
-    // check a few pages that shouldn't be on the free list
-    assert(page2pa(pp) != 0);
-    assert(page2pa(pp) != IOPHYSMEM);
-    assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-    assert(page2pa(pp) != EXTPHYSMEM);
-    assert(page2pa(pp) < EXTPHYSMEM || (char*)page2kva(pp) >= first_free_page);
-    // (new test for lab 4)
-    assert(page2pa(pp) != MPENTRY_PADDR);
-
-    if (page2pa(pp) < EXTPHYSMEM)
-      ++nfree_basemem;
-    else
-      ++nfree_extmem;
-  }
+  for (o = 0; o <= PAGE_MAX_ORDER; o++)
+    for (head = free_area[o]; head; head = head->pp_link) {
+      // check that we didn't corrupt the free lists themselves
+      assert(head >= pages);
+      assert(head + (1 << o) <= pages + npages);
+      assert(((char*)head - (char*)pages) % sizeof(*head) == 0);
+      assert((head - pages) % (1 << o) == 0);
+      assert(head->pp_free && head->pp_order == o);
+      assert(!head->pp_link || head->pp_link->pp_prev == head);
+
+      for (j = 0, pp = head; j < (1 << o); j++, pp++) {
+        // if there's a page that shouldn't be on the free list,
+        // try to make sure it eventually causes trouble.
+        if (PDX(page2pa(pp)) < pdx_limit)
+          memset(page2kva(pp), 0x97, 128);
+
+        // check a few pages that shouldn't be on the free list
+        assert(page2pa(pp) != 0);
+        assert(page2pa(pp) != IOPHYSMEM);
+        assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+        assert(page2pa(pp) != EXTPHYSMEM);
+        assert(page2pa(pp) < EXTPHYSMEM || (char*)page2kva(pp) >= first_free_page);
+        // (new test for lab 4)
+        assert(page2pa(pp) != MPENTRY_PADDR);
+
+        if (page2pa(pp) < EXTPHYSMEM)
+          ++nfree_basemem;
+        else
+          ++nfree_extmem;
+      }
+    }
 
   assert(nfree_basemem > 0);
   assert(nfree_extmem > 0);
 }
 
+//
+// Take every free page, linked through pp_link, so that a check can
+// run with no free memory.  check_give_back returns them.
+//
+static struct PageInfo *
+check_steal_free(void)
+{
+  struct PageInfo *fl = NULL, *pp;
+
+  while ((pp = page_alloc(0))) {
+    pp->pp_link = fl;
+    fl = pp;
+  }
+  return fl;
+}
+
+static void
+check_give_back(struct PageInfo *fl)
+{
+  struct PageInfo *pp;
+
+  while ((pp = fl)) {
+    fl = pp->pp_link;
+    pp->pp_link = NULL;
+    page_free(pp);
+  }
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -841,8 +1360,7 @@ check_page_alloc(void)
     panic("'pages' is a null pointer!");
 
   // check number of free pages
-  for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-    ++nfree;
+  nfree = buddy_nfree();
   
   // should be able to allocate three pages
   pp0 = pp1 = pp2 = 0;
@@ -858,8 +1376,7 @@ check_page_alloc(void)
   assert(page2pa(pp2) < npages*PGSIZE);
 
   // temporarily steal the rest of the free pages
-  fl = page_free_list;
-  page_free_list = 0;
+  fl = check_steal_free();
 
   // should be no free memory
   assert(!page_alloc(0));
@@ -887,7 +1404,7 @@ check_page_alloc(void)
     assert(c[i] == 0);
 
   // give free list back
-  page_free_list = fl;
+  check_give_back(fl);
 
   // free the pages we took
   page_free(pp0);
@@ -895,9 +1412,14 @@ check_page_alloc(void)
   page_free(pp2);
 
   // number of free pages should be the same
-  for (pp = page_free_list; pp; pp = pp->pp_link)
-    --nfree;
-  assert(nfree == 0);
+  assert(buddy_nfree() == nfree);
+
+  // contiguous blocks are aligned to their size and merge back on free
+  assert((pp = page_alloc_order(3, 0)));
+  assert((pp - pages) % 8 == 0);
+  assert(buddy_nfree() == nfree - 8);
+  page_free_order(pp, 3);
+  assert(buddy_nfree() == nfree);
 
   cprintf("check_page_alloc() succeeded!\n");
 }
@@ -959,6 +1481,7 @@ check_kern_pgdir(void)
       if (i >= PDX(KERNBASE)) {
         assert(pgdir[i] & PTE_P);
         assert(pgdir[i] & PTE_W);
+        assert(pgdir[i] & PTE_PS);
       } else
         assert(pgdir[i] == 0);
       break;
@@ -980,6 +1503,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
   pgdir = &pgdir[PDX(va)];
   if (!(*pgdir & PTE_P))
     return ~0;
+  if (*pgdir & PTE_PS)
+    return (*pgdir & ~(PTSIZE - 1)) | (PTX(va) << PTXSHIFT);
   p = (pte_t*)KADDR(PTE_ADDR(*pgdir));
   if (!(p[PTX(va)] & PTE_P))
     return ~0;
@@ -1011,8 +1536,7 @@ check_page(void)
   assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
   // temporarily steal the rest of the free pages
-  fl = page_free_list;
-  page_free_list = 0;
+  fl = check_steal_free();
 
   // should be no free memory
   assert(!page_alloc(0));
@@ -1132,7 +1656,7 @@ check_page(void)
   pp0->pp_ref = 0;
 
   // give free list back
-  page_free_list = fl;
+  check_give_back(fl);
 
   // free the pages we took
   page_free(pp0);
@@ -1206,3 +1730,53 @@ check_page_installed_pgdir(void)
 
   cprintf("check_page_installed_pgdir() succeeded!\n");
 }
+
+// check mapping, replacing and unmapping 4MB pages
+static void
+check_large_page(void)
+{
+  struct PageInfo *pp, *pp1;
+  pte_t *ptep;
+
+  assert(kern_pgdir[0] == 0);
+  assert((pp = page_alloc_order(PAGE_LARGE_ORDER, 0)));
+  assert((pp1 = page_alloc(0)));
+
+  // map a 4MB page at 0 and look it up from the middle
+  assert(page_insert(kern_pgdir, pp, 0x0, PTE_W|PTE_PS) == 0);
+  assert(kern_pgdir[0] & PTE_PS);
+  assert(check_va2pa(kern_pgdir, 5*PGSIZE) == page2pa(pp) + 5*PGSIZE);
+  assert(page_lookup(kern_pgdir, (void*) (5*PGSIZE), &ptep) == pp);
+  assert(ptep == &kern_pgdir[0]);
+  assert(pp->pp_ref == 1);
+  *(uint32_t*) (7*PGSIZE) = 0x12345678;
+  assert(*(uint32_t*) (page2kva(pp) + 7*PGSIZE) == 0x12345678);
+
+  // a 4K page cannot go inside it
+  assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_W) == -E_INVAL);
+  assert(pp1->pp_ref == 0);
+  assert(check_va2pa(kern_pgdir, PGSIZE) == page2pa(pp) + PGSIZE);
+
+  // but can once it is gone
+  page_incref(pp);
+  page_remove(kern_pgdir, 0x0);
+  assert(pp->pp_ref == 1 && kern_pgdir[0] == 0);
+  assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_W) == 0);
+  assert(!(kern_pgdir[0] & PTE_PS));
+  assert(check_va2pa(kern_pgdir, PGSIZE) == page2pa(pp1));
+  assert(check_va2pa(kern_pgdir, 5*PGSIZE) == ~0);
+  assert(pp->pp_ref == 1 && pp1->pp_ref == 1);
+
+  // and mapping it again frees the page table and what it mapped
+  assert(page_insert(kern_pgdir, pp, 0x0, PTE_W|PTE_PS) == 0);
+  assert(check_va2pa(kern_pgdir, PGSIZE) == page2pa(pp) + PGSIZE);
+  assert(pp->pp_ref == 2 && pp1->pp_ref == 0);
+  assert(*(uint32_t*) (7*PGSIZE) == 0x12345678);
+
+  // unmapping any part of it unmaps all of it
+  page_remove(kern_pgdir, (void*) (9*PGSIZE));
+  assert(kern_pgdir[0] == 0 && pp->pp_ref == 1);
+  page_decref(pp);
+
+  cprintf("check_large_page() succeeded!\n");
+}
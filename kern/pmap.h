@@ -46,6 +46,13 @@ _kaddr(const char *file, int line, physaddr_t pa)
 }
 
 
+// Largest order page_alloc_order can allocate: a block of
+// 1 << PAGE_MAX_ORDER physically contiguous pages (4MB, one PTSIZE).
+#define PAGE_MAX_ORDER	10
+
+// Order of the blocks that back 4MB (PTE_PS) pages.
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
@@ -55,12 +62,17 @@ void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
 void num_free_pages(void);
+void	page_zero_idle(void);
+void	page_buddyinfo(void);
 void	page_free(struct PageInfo *pp);
+void	page_free_order(struct PageInfo *pp, int order);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
 pte_t * pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
@@ -69,6 +81,7 @@ void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_lock(struct Env *env, const void *va, size_t len, int perm);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -1,68 +1,1331 @@
 #include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
 #include <inc/x86.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
-#include <time.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/timer.h>
 
-struct Env* ticker;
+struct spinlock sched_lock = SPINLOCK_INIT(sched_lock, LOCK_RANK_SCHED, SPIN_MCS);
 
-void sched_halt(void);
+// The best-effort class and its time slice, chosen at boot by
+// sched_init().
+const struct sched_class *sched_class;
+uint32_t sched_slice_us;
 
-// Choose a user environment to run and run it.
+// MLFQ tuning.  An env at level l may use MLFQ_QUANTUM(l) timer ticks
+// before it is demoted to level l + 1; ticks accumulate across yields
+// so that giving up the CPU just before the tick doesn't hide a hog.
+// Every MLFQ_BOOST_NSEC of kernel clock time all envs return to level
+// 0 so that demoted envs cannot starve.  Each boost starts a new
+// epoch: queued envs are moved up at once, and the others when they
+// are next queued or ticked (see mlfq_enqueue, mlfq_tick).
+#define MLFQ_QUANTUM(l)         (1 << (l))
+#define MLFQ_BOOST_NSEC         (2 * NSEC_PER_SEC)
+
+static uint64_t mlfq_next_boost;        // Kernel clock time (ns)
+static uint32_t mlfq_epoch;             // Boosts so far
+
+// Timers for sys_sleep, indexed by ENVX.
+static struct Timer sleep_timers[NENV];
+
+// When the boot CPU, which runs the timer wheel, last armed its timer
+// to run it next (kernel clock ns), or ~0 if it did not.
+static uint64_t wheel_armed_nsec = ~(uint64_t)0;
+
+// The gang holding the machine (see gang_start), or 0, and the TSC
+// at which its slice ends.  Gangs get GANG_SLICE_US when the
+// best-effort class has no slice.
+static envid_t gang_id;
+static uint64_t gang_end;
+#define GANG_SLICE_US           10000
+
+// Queued members of each gang, in the order they were queued, linked
+// through env_gang_next/env_gang_prev and indexed by ENVX of the gang's
+// name.  Two gangs may share a list if the env one was named after has
+// exited and its slot been reused.
+static struct Env *gang_head[NENV];
+static struct Env *gang_tail[NENV];
+
+// An env that left the CPU less than SCHED_HOT_CYCLES TSC cycles ago
+// probably still has a warm cache there, so idle CPUs leave it be.
+#define SCHED_HOT_CYCLES        1000000
+
+void sched_halt(void) __attribute__((noreturn));
+
+static bool
+env_allowed(struct Env *e, int cpu)
+{
+  return e->env_affinity & (1 << cpu);
+}
+
+static bool
+env_cache_hot(struct Env *e)
+{
+  return e->env_runs > 0 && read_tsc() - e->env_tsc_out < SCHED_HOT_CYCLES;
+}
+
+// Pick the run queue a newly runnable env should wait on, among the
+// CPUs in its affinity mask.  Prefer the CPU that last ran it, whose
+// caches may still be warm; envs that have never run start out on the
+// current CPU and are spread to idle CPUs by work stealing.
+static struct RunQueue *
+runq_home(struct Env *e)
+{
+  int i;
+
+  if (e->env_rt_period)
+    return &cpus[e->env_rt_cpu].cpu_runq;
+  if (e->env_runs > 0 && e->env_cpunum >= 0 && e->env_cpunum < ncpu &&
+      env_allowed(e, e->env_cpunum))
+    return &cpus[e->env_cpunum].cpu_runq;
+  if (env_allowed(e, cpunum()))
+    return &thiscpu->cpu_runq;
+  for (i = 0; i < ncpu; i++)
+    if (env_allowed(e, i))
+      return &cpus[i].cpu_runq;
+  panic("runq_home: env %08x may not run on any CPU", e->env_id);
+}
+
+//
+// FIFO run queues, one list per MLFQ level (only level 0 is used
+// outside SCHED_MLFQ).  Used by RR, SJF, SRTF and MLFQ.
+//
+
+static void
+fifo_enqueue(struct RunQueue *rq, struct Env *e)
+{
+  int lvl = e->env_mlfq_level;
+
+  rq->rq_len++;
+  e->env_rq_next = NULL;
+  e->env_rq_prev = rq->rq_tail[lvl];
+  if (rq->rq_tail[lvl])
+    rq->rq_tail[lvl]->env_rq_next = e;
+  else
+    rq->rq_head[lvl] = e;
+  rq->rq_tail[lvl] = e;
+}
+
+static void
+fifo_dequeue(struct RunQueue *rq, struct Env *e)
+{
+  int lvl = e->env_mlfq_level;
+
+  rq->rq_len--;
+  if (e->env_rq_prev)
+    e->env_rq_prev->env_rq_next = e->env_rq_next;
+  else
+    rq->rq_head[lvl] = e->env_rq_next;
+  if (e->env_rq_next)
+    e->env_rq_next->env_rq_prev = e->env_rq_prev;
+  else
+    rq->rq_tail[lvl] = e->env_rq_prev;
+  e->env_rq_next = e->env_rq_prev = NULL;
+}
+
+// The env at the head of the highest non-empty level.
+static struct Env *
+fifo_pick(struct RunQueue *rq)
+{
+  int lvl;
+
+  for (lvl = 0; lvl < MLFQ_LEVELS; lvl++)
+    if (rq->rq_head[lvl])
+      return rq->rq_head[lvl];
+  return NULL;
+}
+
+static struct Env *
+fifo_next(struct RunQueue *rq, struct Env *e)
+{
+  int lvl;
+
+  if (e && e->env_rq_next)
+    return e->env_rq_next;
+  for (lvl = e ? e->env_mlfq_level + 1 : 0; lvl < MLFQ_LEVELS; lvl++)
+    if (rq->rq_head[lvl])
+      return rq->rq_head[lvl];
+  return NULL;
+}
+
+// The queued env with the smallest key; ties go to the env that has
+// waited longest.
+static struct Env *
+fifo_pick_min(struct RunQueue *rq, uint64_t (*key)(struct Env *))
+{
+  struct Env *e, *best = fifo_pick(rq);
+
+  if (!best)
+    return NULL;
+  for (e = best->env_rq_next; e; e = e->env_rq_next)
+    if (key(e) < key(best))
+      best = e;
+  return best;
+}
+
+//
+// Round-robin: each CPU cycles through its own envs in O(1) per
+// decision, switching on every timer tick.
+//
+
+static bool
+rr_tick(struct RunQueue *rq, struct Env *cur)
+{
+  return 1;
+}
+
+//
+// Shortest job first orders by the declared estimate, shortest
+// remaining time first by what is left of it after the CPU time
+// already used.  Envs without an estimate sort last.
+//
+
+static uint64_t
+sjf_key(struct Env *e)
+{
+  if (e->estRunTime == 0)
+    return ~(uint64_t)0;
+  return (uint64_t)e->estRunTime << ESTRUNTIME_SHIFT;
+}
+
+static uint64_t
+srtf_key(struct Env *e)
+{
+  uint64_t est = sjf_key(e);
+
+  if (e->estRunTime == 0)
+    return est;
+  return est > e->env_cputime ? est - e->env_cputime : 0;
+}
+
+static struct Env *
+sjf_pick(struct RunQueue *rq)
+{
+  return fifo_pick_min(rq, sjf_key);
+}
+
+static struct Env *
+srtf_pick(struct RunQueue *rq)
+{
+  return fifo_pick_min(rq, srtf_key);
+}
+
+// Jobs run to completion (or until they block or yield).
+static bool
+sjf_tick(struct RunQueue *rq, struct Env *cur)
+{
+  return 0;
+}
+
+// Preempt only for a job with less time left.
+static bool
+srtf_tick(struct RunQueue *rq, struct Env *cur)
+{
+  struct Env *next = srtf_pick(rq);
+
+  return next && srtf_key(next) < srtf_key(cur);
+}
+
+//
+// Proportional share: CFS and stride scheduling keep each run queue
+// in a red-black tree ordered by a per-env virtual time, weighted
+// runtime for CFS and pass for stride, and run the env furthest
+// behind.
+//
+
+static void
+vt_enqueue(struct RunQueue *rq, struct Env *e, uint64_t *vt)
+{
+  // An env that slept (or is new) must not bank the time it was
+  // away and then monopolize the CPU: start it no earlier than the
+  // queue's current minimum.
+  rq->rq_len++;
+  if (*vt < rq->rq_min_key)
+    *vt = rq->rq_min_key;
+  e->env_rq_node.rb_key = *vt;
+  rb_insert(&rq->rq_tree, &e->env_rq_node);
+}
+
+static void
+vt_dequeue(struct RunQueue *rq, struct Env *e)
+{
+  rq->rq_len--;
+  if (rb_first(&rq->rq_tree) == &e->env_rq_node &&
+      e->env_rq_node.rb_key > rq->rq_min_key)
+    rq->rq_min_key = e->env_rq_node.rb_key;
+  rb_remove(&rq->rq_tree, &e->env_rq_node);
+}
+
+static struct Env *
+vt_pick(struct RunQueue *rq)
+{
+  struct rb_node *n = rb_first(&rq->rq_tree);
+
+  return n ? rb_entry(n, struct Env, env_rq_node) : NULL;
+}
+
+static struct Env *
+vt_next(struct RunQueue *rq, struct Env *e)
+{
+  struct rb_node *n = e ? rb_next(&e->env_rq_node) : rb_first(&rq->rq_tree);
+
+  return n ? rb_entry(n, struct Env, env_rq_node) : NULL;
+}
+
+static void
+cfs_enqueue(struct RunQueue *rq, struct Env *e)
+{
+  vt_enqueue(rq, e, &e->env_vruntime);
+}
+
+// Preempt once some queued env is behind in virtual time.
+static bool
+cfs_tick(struct RunQueue *rq, struct Env *cur)
+{
+  struct Env *next = vt_pick(rq);
+
+  return next && next->env_vruntime < cur->env_vruntime;
+}
+
+// Virtual times are only comparable within one queue; start a
+// migrated env level with its new queue.
+static void
+cfs_migrate(struct RunQueue *rq, struct Env *e)
+{
+  e->env_vruntime = rq->rq_min_key;
+}
+
+// Trade places in virtual time, so that 'to' runs on cur's share and
+// cur pays for it, rather than 'to' being preempted at the next tick.
+static void
+cfs_yield_to(struct Env *cur, struct Env *to)
+{
+  uint64_t vt = cur->env_vruntime;
+
+  if (to->env_vruntime > vt) {
+    cur->env_vruntime = to->env_vruntime;
+    to->env_vruntime = vt;
+  }
+}
+
+static void
+stride_enqueue(struct RunQueue *rq, struct Env *e)
+{
+  vt_enqueue(rq, e, &e->env_pass);
+}
+
+static bool
+stride_tick(struct RunQueue *rq, struct Env *cur)
+{
+  struct Env *next = vt_pick(rq);
+
+  return next && next->env_pass < cur->env_pass;
+}
+
+static void
+stride_migrate(struct RunQueue *rq, struct Env *e)
+{
+  e->env_pass = rq->rq_min_key;
+}
+
+static void
+stride_yield_to(struct Env *cur, struct Env *to)
+{
+  uint64_t pass = cur->env_pass;
+
+  if (to->env_pass > pass) {
+    cur->env_pass = to->env_pass;
+    to->env_pass = pass;
+  }
+}
+
+//
+// Multi-level feedback queue: round-robin within the highest
+// non-empty level.
+//
+
+// Give e the current boost: back to the top level with a fresh
+// quantum.
+static void
+mlfq_reset(struct Env *e)
+{
+  e->env_mlfq_level = 0;
+  e->env_mlfq_ticks = 0;
+  e->env_mlfq_epoch = mlfq_epoch;
+}
+
+// Move every queued env back to the top MLFQ level, keeping each
+// queue's order from the highest level down.  Envs that are running
+// or blocked catch up in mlfq_enqueue or mlfq_tick.
+static void
+mlfq_boost(void)
+{
+  struct RunQueue *rq;
+  struct Env *e;
+  int i, lvl;
+
+  mlfq_epoch++;
+  for (i = 0; i < ncpu; i++) {
+    rq = &cpus[i].cpu_runq;
+    for (lvl = 0; lvl < MLFQ_LEVELS; lvl++)
+      for (e = rq->rq_head[lvl]; e; e = e->env_rq_next)
+        mlfq_reset(e);
+    for (lvl = 1; lvl < MLFQ_LEVELS; lvl++) {
+      if (!rq->rq_head[lvl])
+        continue;
+      if (rq->rq_tail[0]) {
+        rq->rq_tail[0]->env_rq_next = rq->rq_head[lvl];
+        rq->rq_head[lvl]->env_rq_prev = rq->rq_tail[0];
+      } else
+        rq->rq_head[0] = rq->rq_head[lvl];
+      rq->rq_tail[0] = rq->rq_tail[lvl];
+      rq->rq_head[lvl] = rq->rq_tail[lvl] = NULL;
+    }
+  }
+}
+
+static void
+mlfq_enqueue(struct RunQueue *rq, struct Env *e)
+{
+  if (e->env_mlfq_epoch != mlfq_epoch)
+    mlfq_reset(e);
+  fifo_enqueue(rq, e);
+}
+
+// An env that used up its quantum is CPU-bound: demote it and let the
+// rest of its level run.  Otherwise preempt only for an env at a
+// higher level, such as one just woken by IPC.
+static bool
+mlfq_tick(struct RunQueue *rq, struct Env *cur)
+{
+  struct Env *next;
+  uint64_t now = time_nsec();
+
+  if (now >= mlfq_next_boost) {
+    mlfq_next_boost = now + MLFQ_BOOST_NSEC;
+    mlfq_boost();
+  }
+  if (cur->env_mlfq_epoch != mlfq_epoch)
+    mlfq_reset(cur);
+  if (++cur->env_mlfq_ticks >= MLFQ_QUANTUM(cur->env_mlfq_level)) {
+    cur->env_mlfq_ticks = 0;
+    if (cur->env_mlfq_level < MLFQ_LEVELS - 1)
+      cur->env_mlfq_level++;
+    return 1;
+  }
+  next = fifo_pick(rq);
+  return next && next->env_mlfq_level < cur->env_mlfq_level;
+}
+
+//
+// Earliest deadline first, for envs with a real-time reservation
+// (see sched_rt_reserve).  Each CPU keeps its ready real-time envs in
+// rq_rt_tree ordered by deadline; they run ahead of the best-effort
+// class and are never stolen.
+//
+
+// A real-time env may not run once its current job is finished or has
+// used up its budget, until its next period starts.
+static bool
+rt_throttled(struct Env *e)
+{
+  return e->env_rt_done ||
+    e->env_rt_used >= (uint64_t)e->env_rt_budget << RT_TIME_SHIFT;
+}
+
+static void
+rt_insert(struct RunQueue *rq, struct Env *e)
+{
+  e->env_rq_node.rb_key = e->env_rt_deadline;
+  rb_insert(&rq->rq_rt_tree, &e->env_rq_node);
+  e->env_rt_ready = 1;
+}
+
+static void
+rt_remove(struct RunQueue *rq, struct Env *e)
+{
+  rb_remove(&rq->rq_rt_tree, &e->env_rq_node);
+  e->env_rt_ready = 0;
+}
+
+// Start a new period for every real-time env on rq whose deadline has
+// passed, counting a miss if its job was still waiting to run.  A job
+// throttled because it used up its budget got all the time it
+// reserved, so the scheduler did not miss its deadline.
+static void
+rt_release(struct RunQueue *rq)
+{
+  uint64_t now = read_tsc();
+  uint64_t period;
+  struct Env *e;
+
+  for (e = rq->rq_rt_list; e; e = e->env_rt_next) {
+    if (now < e->env_rt_deadline)
+      continue;
+    if (!rt_throttled(e) && (e->env_status == ENV_RUNNABLE ||
+                             e->env_status == ENV_RUNNING))
+      e->env_rt_misses++;
+    // Skip any whole periods that went by.
+    period = (uint64_t)e->env_rt_period << RT_TIME_SHIFT;
+    do
+      e->env_rt_deadline += period;
+    while (e->env_rt_deadline <= now);
+    e->env_rt_used = 0;
+    e->env_rt_done = 0;
+    e->env_rt_jobs++;
+    if (e->env_runq) {
+      if (e->env_rt_ready)
+        rt_remove(rq, e);
+      rt_insert(rq, e);
+    }
+  }
+}
+
+// A throttled env stays off the tree (but counts as queued) until
+// rt_release() starts its next period.
+static void
+edf_enqueue(struct RunQueue *rq, struct Env *e)
+{
+  if (!rt_throttled(e))
+    rt_insert(rq, e);
+}
+
+static void
+edf_dequeue(struct RunQueue *rq, struct Env *e)
+{
+  if (e->env_rt_ready)
+    rt_remove(rq, e);
+}
+
+static struct Env *
+edf_pick(struct RunQueue *rq)
+{
+  struct rb_node *n;
+
+  rt_release(rq);
+  n = rb_first(&rq->rq_rt_tree);
+  return n ? rb_entry(n, struct Env, env_rq_node) : NULL;
+}
+
+// A real-time env runs until it finishes its job, exhausts its
+// budget, or an env with an earlier deadline is released.
+static bool
+edf_tick(struct RunQueue *rq, struct Env *cur)
+{
+  struct Env *next = edf_pick(rq);
+
+  return rt_throttled(cur) ||
+    (next && next->env_rt_deadline < cur->env_rt_deadline);
+}
+
+// Yielding ends the current job.
+static void
+edf_yield(struct Env *e)
+{
+  e->env_rt_done = 1;
+}
+
+//
+// Class tables.
+//
+
+static const struct sched_class edf_class = {
+  .name = "edf",
+  .enqueue = edf_enqueue,
+  .dequeue = edf_dequeue,
+  .pick_next = edf_pick,
+  .tick = edf_tick,
+  .yield = edf_yield,
+};
+
+static const struct sched_class rr_class = {
+  .name = "rr",
+  .slice_us = 10000,
+  .enqueue = fifo_enqueue,
+  .dequeue = fifo_dequeue,
+  .pick_next = fifo_pick,
+  .next = fifo_next,
+  .tick = rr_tick,
+};
+
+static const struct sched_class sjf_class = {
+  .name = "sjf",
+  .slice_us = 0,
+  .enqueue = fifo_enqueue,
+  .dequeue = fifo_dequeue,
+  .pick_next = sjf_pick,
+  .next = fifo_next,
+  .tick = sjf_tick,
+};
+
+static const struct sched_class srtf_class = {
+  .name = "srtf",
+  .slice_us = 10000,
+  .enqueue = fifo_enqueue,
+  .dequeue = fifo_dequeue,
+  .pick_next = srtf_pick,
+  .next = fifo_next,
+  .tick = srtf_tick,
+};
+
+static const struct sched_class cfs_class = {
+  .name = "cfs",
+  .slice_us = 4000,
+  .enqueue = cfs_enqueue,
+  .dequeue = vt_dequeue,
+  .pick_next = vt_pick,
+  .next = vt_next,
+  .tick = cfs_tick,
+  .yield_to = cfs_yield_to,
+  .migrate = cfs_migrate,
+};
+
+static const struct sched_class stride_class = {
+  .name = "stride",
+  .slice_us = 10000,
+  .enqueue = stride_enqueue,
+  .dequeue = vt_dequeue,
+  .pick_next = vt_pick,
+  .next = vt_next,
+  .tick = stride_tick,
+  .yield_to = stride_yield_to,
+  .migrate = stride_migrate,
+};
+
+static const struct sched_class mlfq_class = {
+  .name = "mlfq",
+  .slice_us = 10000,
+  .enqueue = mlfq_enqueue,
+  .dequeue = fifo_dequeue,
+  .pick_next = fifo_pick,
+  .next = fifo_next,
+  .tick = mlfq_tick,
+};
+
+// Best-effort classes, indexed by policy.
+static const struct sched_class *sched_classes[] = {
+  [SCHED_RR] = &rr_class,
+  [SCHED_SJF] = &sjf_class,
+  [SCHED_SRTF] = &srtf_class,
+  [SCHED_CFS] = &cfs_class,
+  [SCHED_STRIDE] = &stride_class,
+  [SCHED_MLFQ] = &mlfq_class,
+};
+
+#define NSCHED_CLASSES (sizeof(sched_classes)/sizeof(sched_classes[0]))
+
+// Select the best-effort class from a "sched=<name>" option on the
+// kernel command line, falling back to the build-time SCHED_POLICY,
+// and its time slice from a "slice=<microseconds>" option, falling
+// back to the class's default.
 void
-sched_yield(void)
+sched_init(const char *cmdline)
 {
-  struct Env *idle;
-
-        // Implement simple round-robin scheduling.
-        //
-        // Search through 'envs' for an ENV_RUNNABLE environment in
-        // circular fashion starting just after the env this CPU was
-        // last running.  Switch to the first such environment found.
-        //
-        // If no envs are runnable, but the environment previously
-        // running on this CPU is still ENV_RUNNING, it's okay to
-        // choose that environment.
-        //
-        // Never choose an environment that's currently running on
-        // another CPU (env_status == ENV_RUNNING). If there are
-        // no runnable environments, simply drop through to the code
-        // below to halt the cpu.
-
-  // LAB 4: Your code here.
-  struct Env* env = thiscpu->cpu_env;
-  int curEnvIndex,i;
-  if(ticker->env_status == ENV_RUNNABLE)
-    env_run(ticker);
-  if(env == 0){
-    curEnvIndex = -1;
-  }else{
-    curEnvIndex = ENVX(env->env_id);
-  }
-  for(i=curEnvIndex+1;i<NENV;i++){
-    struct Env* env = &envs[i];
-    if(env->env_status == ENV_RUNNABLE){
-      env_run(env);
+  const char *p;
+  long slice = 0;
+  int i, n;
+
+  sched_class = sched_classes[SCHED_POLICY];
+  for (p = cmdline; p && *p; p = strchr(p, ' ')) {
+    while (*p == ' ')
+      p++;
+    if (strncmp(p, "slice=", 6) == 0)
+      slice = strtol(p + 6, NULL, 10);
+    if (strncmp(p, "sched=", 6) != 0)
+      continue;
+    p += 6;
+    for (i = 0; i < NSCHED_CLASSES; i++) {
+      n = strlen(sched_classes[i]->name);
+      if (strncmp(p, sched_classes[i]->name, n) == 0 &&
+          (p[n] == '\0' || p[n] == ' '))
+        break;
     }
+    if (i < NSCHED_CLASSES)
+      sched_class = sched_classes[i];
+    else
+      cprintf("SCHED: unknown policy in '%s'\n", cmdline);
   }
-  if(curEnvIndex!=0){
-    for(i=0;i<curEnvIndex;i++){
-      struct Env* env = &envs[i];
-      if(env->env_status == ENV_RUNNABLE){
-        env_run(env);
-      }
+  sched_slice_us = slice > 0 ? slice : sched_class->slice_us;
+  cprintf("SCHED: %s policy, %u us slice\n", sched_class->name,
+          sched_slice_us);
+}
+
+// The class that schedules e.
+static const struct sched_class *
+env_class(struct Env *e)
+{
+  return e->env_rt_period ? &edf_class : sched_class;
+}
+
+// Send c a reschedule IPI (see sched_ipi).
+static void
+cpu_kick(struct CpuInfo *c)
+{
+  if (c->cpu_status == CPU_HALTED)
+    c->cpu_kicked = 1;
+  lapic_ipi_cpu(c->cpu_id, T_RESCHED);
+}
+
+// CPUs stop their timers when they have nothing to wait for (see
+// sched_timer_arm), so new work must be announced.  Interrupt rq's
+// CPU if it would otherwise sleep through e or if e is real-time and
+// may need to preempt what is running there.  Otherwise, if e could be
+// stolen, wake one halted CPU that is allowed to run it and has not
+// already been woken for earlier work.  A cache-hot env is left to its
+// own CPU unless it is queued behind another env, as an env requeued
+// at the end of its slice is: then the woken CPU, finding it hot, sets
+// its timer to steal it once it has cooled (see sched_timer_arm).
+static void
+sched_kick(struct RunQueue *rq, struct Env *e)
+{
+  struct CpuInfo *c;
+
+  for (c = cpus; c < cpus + ncpu; c++) {
+    if (&c->cpu_runq != rq)
+      continue;
+    if (c != thiscpu && (c->cpu_tickless || e->env_rt_period ||
+                         c->cpu_status == CPU_HALTED)) {
+      cpu_kick(c);
+      return;
+    }
+    break;
+  }
+  if (e->env_rt_period || (env_cache_hot(e) && rq->rq_len < 2))
+    return;
+  for (c = cpus; c < cpus + ncpu; c++) {
+    if (c != thiscpu && c->cpu_status == CPU_HALTED && !c->cpu_kicked &&
+        env_allowed(e, c - cpus)) {
+      cpu_kick(c);
+      return;
+    }
+  }
+}
+
+// Append e to the queued members of its gang.
+static void
+gang_enqueue(struct Env *e)
+{
+  int g = ENVX(e->env_gang);
+
+  e->env_gang_next = NULL;
+  e->env_gang_prev = gang_tail[g];
+  if (gang_tail[g])
+    gang_tail[g]->env_gang_next = e;
+  else
+    gang_head[g] = e;
+  gang_tail[g] = e;
+}
+
+static void
+gang_dequeue(struct Env *e)
+{
+  int g = ENVX(e->env_gang);
+
+  if (e->env_gang_prev)
+    e->env_gang_prev->env_gang_next = e->env_gang_next;
+  else
+    gang_head[g] = e->env_gang_next;
+  if (e->env_gang_next)
+    e->env_gang_next->env_gang_prev = e->env_gang_prev;
+  else
+    gang_tail[g] = e->env_gang_prev;
+}
+
+// Add e to its home run queue.
+void
+sched_enqueue(struct Env *e)
+{
+  struct RunQueue *rq;
+
+  if (e->env_runq)
+    return;
+  rq = runq_home(e);
+  e->env_runq = rq;
+  e->env_tsc_queued = read_tsc();
+  env_class(e)->enqueue(rq, e);
+  if (e->env_gang)
+    gang_enqueue(e);
+  sched_kick(rq, e);
+}
+
+// Unlink e from whichever run queue it is on, if any.
+void
+sched_dequeue(struct Env *e)
+{
+  struct RunQueue *rq = e->env_runq;
+
+  if (!rq)
+    return;
+  env_class(e)->dequeue(rq, e);
+  if (e->env_gang)
+    gang_dequeue(e);
+  e->env_runq = NULL;
+  e->env_waittime += read_tsc() - e->env_tsc_queued;
+}
+
+// e is giving up the CPU voluntarily with sys_yield.
+void
+sched_env_yield(struct Env *e)
+{
+  const struct sched_class *cls = env_class(e);
+
+  if (cls->yield)
+    cls->yield(e);
+}
+
+// Take e off its run queue to run it on this CPU.
+static void
+runq_take(struct Env *e)
+{
+  struct RunQueue *from = e->env_runq;
+
+  sched_dequeue(e);
+  if (from != &thiscpu->cpu_runq && sched_class->migrate)
+    sched_class->migrate(&thiscpu->cpu_runq, e);
+}
+
+// Whether this CPU may take e from another CPU's queue.
+static bool
+env_stealable(struct Env *e)
+{
+  return env_allowed(e, cpunum()) && !env_cache_hot(e);
+}
+
+// The env this CPU would steal from rq: the one rq runs next if
+// possible, otherwise the first queued env that may be stolen, so that
+// a pinned or cache-hot env at the head does not hold up the rest.
+static struct Env *
+runq_stealable(struct RunQueue *rq)
+{
+  struct Env *e = sched_class->pick_next(rq);
+
+  if (e && env_stealable(e))
+    return e;
+  for (e = sched_class->next(rq, NULL); e; e = sched_class->next(rq, e))
+    if (env_stealable(e))
+      return e;
+  return NULL;
+}
+
+// This CPU has nothing queued: take an env from the busiest other
+// CPU's run queue that has one which may run here and is not
+// cache-hot where it is.  Returns NULL if there is nothing to steal.
+static struct Env *
+runq_steal(void)
+{
+  struct RunQueue *rq, *busiest = NULL;
+  struct Env *e, *best = NULL;
+  int i;
+
+  for (i = 0; i < ncpu; i++) {
+    rq = &cpus[i].cpu_runq;
+    if (rq == &thiscpu->cpu_runq || rq->rq_len == 0 ||
+        (busiest && rq->rq_len <= busiest->rq_len))
+      continue;
+    if (!(e = runq_stealable(rq)))
+      continue;
+    busiest = rq;
+    best = e;
+  }
+  if (!(e = best))
+    return NULL;
+  runq_take(e);
+  return e;
+}
+
+// This CPU is going idle: how many TSC cycles until it should look for
+// work to steal again, or ~0 if there is none.  runq_steal passes over
+// cache-hot envs, so an env queued on another CPU can be stolen once
+// it has been off its CPU for SCHED_HOT_CYCLES; look at every env
+// allowed here, not just each queue's head.
+static uint64_t
+steal_wait(uint64_t now)
+{
+  struct RunQueue *rq;
+  struct Env *e;
+  uint64_t wait = ~(uint64_t)0, t;
+  int i;
+
+  for (i = 0; i < ncpu; i++) {
+    rq = &cpus[i].cpu_runq;
+    if (rq == &thiscpu->cpu_runq || rq->rq_len == 0)
+      continue;
+    for (e = sched_class->next(rq, NULL); e; e = sched_class->next(rq, e)) {
+      if (!env_allowed(e, cpunum()))
+        continue;
+      t = now - e->env_tsc_out;
+      t = t < SCHED_HOT_CYCLES ? SCHED_HOT_CYCLES - t : 0;
+      if (t < wait)
+        wait = t;
     }
   }
-  if(curEnvIndex>=0 && envs[curEnvIndex].env_status == ENV_RUNNING){
-    env_run(&envs[curEnvIndex]);
+  return wait;
+}
+
+// Gang scheduling.  Best-effort envs with the same nonzero env_gang
+// (set with sys_env_set_gang) are co-scheduled: when a CPU starts a
+// member of a gang, that gang holds the machine for one slice.  The
+// CPU interrupts the others, and until the slice ends every CPU runs
+// queued members of the gang ahead of its own best-effort envs,
+// taking them from other CPUs' queues if need be.  Members of a
+// parallel job then run side by side instead of spinning on barriers
+// while their peers wait for a CPU.
+
+// The queued member of the gang holding the machine that has waited
+// longest and may run on this CPU, or NULL.  Members run at the end of
+// a slice are queued again behind the rest, so a gang with more
+// members than CPUs takes turns from one gang slice to the next.
+static struct Env *
+gang_pick(void)
+{
+  struct Env *e;
+
+  if (!gang_id || read_tsc() >= gang_end)
+    return NULL;
+  for (e = gang_head[ENVX(gang_id)]; e; e = e->env_gang_next)
+    if (e->env_gang == gang_id && !e->env_rt_period &&
+        env_allowed(e, cpunum()))
+      return e;
+  return NULL;
+}
+
+// e is about to run on this CPU.  If it is a member of a gang that
+// does not already hold the machine, give that gang the machine and
+// have the other CPUs reschedule to pick up its members.
+static void
+gang_start(struct Env *e)
+{
+  struct CpuInfo *c;
+  uint64_t now = read_tsc();
+  uint32_t us = sched_slice_us ? sched_slice_us : GANG_SLICE_US;
+
+  if (!e->env_gang || e->env_rt_period ||
+      (e->env_gang == gang_id && now < gang_end))
+    return;
+  gang_id = e->env_gang;
+  gang_end = now + tsc_hz * us / 1000000;
+  for (c = cpus; c < cpus + ncpu; c++)
+    if (c != thiscpu)
+      cpu_kick(c);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+  struct RunQueue *rq = &thiscpu->cpu_runq;
+  struct Env *e;
+
+  // Runnable envs wait on the queue of the CPU that last ran them;
+  // env_run() requeues the env it switches away from.  Real-time
+  // envs reserved on this CPU run first, earliest deadline first;
+  // then members of the gang holding the machine, if any; then the
+  // best-effort class picks from the local queue.  A CPU whose queue
+  // is empty steals from the busiest other CPU before giving up.
+  //
+  // If nothing is queued anywhere but the environment previously
+  // running on this CPU is still ENV_RUNNING, keep running it.
+  // Otherwise halt the CPU.
+  if ((e = edf_class.pick_next(rq)) || (e = gang_pick()) ||
+      (e = sched_class->pick_next(rq))) {
+    runq_take(e);
+    gang_start(e);
+    env_run(e);
+  }
+  if ((e = runq_steal())) {
+    gang_start(e);
+    env_run(e);
+  }
+
+  if (curenv && curenv->env_status == ENV_RUNNING) {
+    if (env_allowed(curenv, cpunum()) &&
+        (!curenv->env_rt_period || !rt_throttled(curenv)))
+      env_run(curenv);
+    // A throttled real-time env waits on its queue for its next
+    // period; an env no longer allowed here moves to a CPU that is.
+    env_set_status(curenv, ENV_RUNNABLE);
   }
 
   // sched_halt never returns
   sched_halt();
 }
 
+// Switch away from curenv involuntarily.
+static void __attribute__((noreturn))
+sched_preempt(void)
+{
+  curenv->env_preempted = 1;
+  sched_yield();
+}
+
+// Directed yield: run 'to' next on this CPU, for the rest of curenv's
+// time slice (the slice timer keeps running).  Falls back to an
+// ordinary sched_yield() if 'to' is not a runnable best-effort env that
+// may run here, or if a real-time env is waiting for this CPU.
+void
+sched_yield_to(struct Env *to)
+{
+  struct RunQueue *rq = &thiscpu->cpu_runq;
+  struct RunQueue *from = to->env_runq;
+
+  if (to == curenv || to->env_status != ENV_RUNNABLE || to->env_rt_period ||
+      !env_allowed(to, cpunum()) || edf_class.pick_next(rq))
+    sched_yield();
+
+  sched_dequeue(to);
+  if (from != rq && sched_class->migrate)
+    sched_class->migrate(rq, to);
+  if (curenv && curenv->env_status == ENV_RUNNING &&
+      !curenv->env_rt_period && sched_class->yield_to)
+    sched_class->yield_to(curenv, to);
+  env_run(to);
+}
+
+// Reschedule IPI: another CPU queued work for this one (sched_kick),
+// changed where curenv may run, or gave a gang the machine
+// (gang_start).  Unlike sched_tick this does not
+// end curenv's slice; returning to curenv re-arms the timer for
+// whatever it now has to wait for.
+void
+sched_ipi(void)
+{
+  struct RunQueue *rq = &thiscpu->cpu_runq;
+  struct Env *next;
+
+  lock_sched();
+  if (!curenv || curenv->env_status != ENV_RUNNING)
+    sched_yield();
+  if (!env_allowed(curenv, cpunum()))
+    sched_preempt();
+
+  // A newly released real-time env preempts best-effort envs and
+  // real-time envs with a later deadline.
+  next = edf_class.pick_next(rq);
+  if (next && (!curenv->env_rt_period ||
+               next->env_rt_deadline < curenv->env_rt_deadline))
+    sched_preempt();
+  // Best-effort envs outside the gang holding the machine make way for
+  // its members.
+  if (!curenv->env_rt_period && curenv->env_gang != gang_id && gang_pick())
+    sched_preempt();
+  unlock_sched();
+}
+
+// Timer interrupt: decide whether to preempt the current env.
+void
+sched_tick(void)
+{
+  struct RunQueue *rq = &thiscpu->cpu_runq;
+  const struct sched_class *cls;
+
+  lock_sched();
+  timer_run();
+  if (!curenv || curenv->env_status != ENV_RUNNING)
+    sched_yield();
+  if (!env_allowed(curenv, cpunum()))
+    sched_preempt();
+
+  // Best-effort envs give way to any ready real-time env.
+  cls = env_class(curenv);
+  if (cls != &edf_class && edf_class.pick_next(rq))
+    sched_preempt();
+  if (cls->tick(rq, curenv))
+    sched_preempt();
+  unlock_sched();
+}
+
+// The CPU is switching from prev (NULL if it was idle) to next (NULL
+// if it is going idle).  Charge prev for the kernel time since it
+// trapped and count the switch, and note next's first run.  If prev
+// was destroyed while it ran here, leave it for env_reap() to free.
+void
+sched_switch(struct Env *prev, struct Env *next)
+{
+  uint64_t now = read_tsc();
+
+  if (prev) {
+    prev->env_systime += now - prev->env_tsc_out;
+    prev->env_tsc_out = now;
+    if (prev != next) {
+      if (prev->env_preempted)
+        prev->env_nivcsw++;
+      else
+        prev->env_nvcsw++;
+      if (prev->env_status == ENV_DYING)
+        thiscpu->cpu_zombie = prev;
+    }
+    prev->env_preempted = 0;
+  }
+  if (next && next->env_runs == 0)
+    next->env_first_nsec = time_nsec();
+}
+
+// Program this CPU's timer for the scheduler's next decision point,
+// before returning to user mode or halting.  That is the end of the
+// current slice if other best-effort envs are waiting for this CPU
+// (a slice in progress is not restarted), the next release of a
+// real-time env reserved here, the point where the running real-time
+// env exhausts its budget, (on the boot CPU) the next timer wheel
+// event, or, on an idle CPU, the point where an env queued behind
+// another CPU's running env may be stolen, whichever comes first.  With
+// none of these the timer is left to stop, and an env running alone
+// runs undisturbed (and an idle CPU stays halted) until it blocks or
+// sched_kick() announces new work.
+void
+sched_timer_arm(void)
+{
+  struct RunQueue *rq = &thiscpu->cpu_runq;
+  uint64_t now = read_tsc(), wait = ~(uint64_t)0, t, budget, ns;
+  uint32_t count, left = lapic_timer_count();
+  struct Env *e;
+
+  if (rq->rq_len > 0 && sched_slice_us && left == 0 &&
+      !(curenv && curenv->env_rt_period))
+    wait = tsc_hz * sched_slice_us / 1000000;
+  for (e = rq->rq_rt_list; e; e = e->env_rt_next) {
+    t = e->env_rt_deadline > now ? e->env_rt_deadline - now : 0;
+    if (t < wait)
+      wait = t;
+  }
+  if (curenv && curenv->env_rt_period) {
+    budget = (uint64_t)curenv->env_rt_budget << RT_TIME_SHIFT;
+    t = budget > curenv->env_rt_used ? budget - curenv->env_rt_used : 0;
+    if (t < wait)
+      wait = t;
+  }
+  if (!curenv && (t = steal_wait(now)) < wait)
+    wait = t;
+  if (thiscpu == bootcpu) {
+    wheel_armed_nsec = timer_next();
+    if (wheel_armed_nsec != ~(uint64_t)0) {
+      ns = time_nsec();
+      t = wheel_armed_nsec > ns ? nsec_to_tsc(wheel_armed_nsec - ns) : 0;
+      if (t < wait)
+        wait = t;
+    }
+  }
+
+  if (wait == ~(uint64_t)0) {
+    thiscpu->cpu_tickless = (left == 0);
+    return;
+  }
+  thiscpu->cpu_tickless = 0;
+  if ((count = lapic_timer_cycles(wait)) == 0)
+    count = 1;
+  if (left == 0 || count < left)
+    lapic_timer_oneshot(count);
+}
+
+static void
+sleep_expire(void *arg)
+{
+  env_set_status((struct Env *) arg, ENV_RUNNABLE);
+}
+
+// Block e until nsec nanoseconds from now (for ever if that is past
+// the end of the kernel clock).
+void
+sched_sleep(struct Env *e, uint64_t nsec)
+{
+  struct Timer *t = &sleep_timers[ENVX(e->env_id)];
+  uint64_t now = time_nsec();
+  uint64_t when = nsec < ~(uint64_t)0 - now ? now + nsec : ~(uint64_t)0;
+
+  env_set_status(e, ENV_NOT_RUNNABLE);
+  t->tm_func = sleep_expire;
+  t->tm_arg = e;
+  timer_add(t, when);
+  // Get the boot CPU to re-arm its timer if this timer is due before
+  // the wheel's next event was.
+  if (thiscpu != bootcpu && when < wheel_armed_nsec)
+    cpu_kick(bootcpu);
+}
+
+// e is being woken or freed: cancel its sleep, if any.
+void
+sched_sleep_cancel(struct Env *e)
+{
+  timer_cancel(&sleep_timers[ENVX(e->env_id)]);
+}
+
+// The tickets e currently holds for stride scheduling: its own, unless
+// it has lent them to the env it is waiting on, plus any lent to it.
+static uint32_t
+stride_tickets(struct Env *e)
+{
+  uint32_t t = (e->env_donee ? 0 : e->env_tickets) + e->env_tickets_lent;
+
+  return t ? t : 1;
+}
+
+void
+sched_charge(struct Env *e)
+{
+  uint64_t now = read_tsc();
+  uint64_t delta = now - e->env_tsc_in;
+
+  e->env_cputime += delta;
+  e->env_vruntime += delta * ENV_WEIGHT_DEFAULT / e->env_weight;
+  e->env_pass += delta * ENV_TICKETS_DEFAULT / stride_tickets(e);
+  if (e->env_rt_period)
+    e->env_rt_used += delta;
+  e->env_tsc_out = now;
+}
+
+// Lend from's tickets to 'to', which from is blocked waiting on,
+// replacing any earlier loan.
+void
+sched_donate(struct Env *from, struct Env *to)
+{
+  if (from->env_donee == to->env_id || from == to)
+    return;
+  sched_revoke(from);
+  to->env_tickets_lent += from->env_tickets;
+  from->env_donee = to->env_id;
+}
+
+// Take back the tickets from has lent, if any.
+void
+sched_revoke(struct Env *from)
+{
+  struct Env *to;
+
+  if (!from->env_donee)
+    return;
+  to = &envs[ENVX(from->env_donee)];
+  if (to->env_id == from->env_donee && to->env_status != ENV_FREE)
+    to->env_tickets_lent -= from->env_tickets;
+  from->env_donee = 0;
+}
+
+// End every loan to 'to', which is exiting, so that its lenders run
+// on their own tickets again.
+void
+sched_revoke_to(struct Env *to)
+{
+  int i;
+
+  for (i = 0; i < NENV && to->env_tickets_lent; i++)
+    if (envs[i].env_donee == to->env_id)
+      sched_revoke(&envs[i]);
+}
+
+// Share of a CPU, out of RT_UTIL_ONE, used by a reservation.
+static int
+rt_util(uint32_t period, uint32_t budget)
+{
+  return ((uint64_t)budget * RT_UTIL_ONE + period - 1) / period;
+}
+
+// Drop e's real-time reservation, if it has one.
+static void
+rt_unreserve(struct Env *e)
+{
+  struct RunQueue *rq;
+  struct Env **pp;
+
+  if (!e->env_rt_period)
+    return;
+  rq = &cpus[e->env_rt_cpu].cpu_runq;
+  for (pp = &rq->rq_rt_list; *pp != e; pp = &(*pp)->env_rt_next)
+    /* do nothing */;
+  *pp = e->env_rt_next;
+  rq->rq_rt_util -= rt_util(e->env_rt_period, e->env_rt_budget);
+  e->env_rt_period = 0;
+}
+
+// Replace e's real-time reservation with one for 'budget' out of every
+// 'period' (RT_TIME_SHIFT units), or cancel it if period is 0.  The
+// reservation is placed on the first CPU in e's affinity mask with
+// room for it (partitioned
+// EDF: each CPU's reserved share stays at or below RT_UTIL_MAX, so all
+// admitted budgets can be met).  On failure the old reservation stays.
+// Returns 0 on success or -E_NO_CPU if no CPU has room.
+int
+sched_rt_reserve(struct Env *e, uint32_t period, uint32_t budget)
+{
+  struct RunQueue *rq;
+  bool queued;
+  int i, util, avail;
+
+  if (period) {
+    util = rt_util(period, budget);
+    for (i = 0; i < ncpu; i++) {
+      rq = &cpus[i].cpu_runq;
+      if (!env_allowed(e, i))
+        continue;
+      avail = RT_UTIL_MAX - rq->rq_rt_util;
+      if (e->env_rt_period && e->env_rt_cpu == i)
+        avail += rt_util(e->env_rt_period, e->env_rt_budget);
+      if (util <= avail)
+        break;
+    }
+    if (i == ncpu)
+      return -E_NO_CPU;
+  }
+
+  if ((queued = (e->env_runq != NULL)))
+    sched_dequeue(e);
+  rt_unreserve(e);
+  if (period) {
+    rq = &cpus[i].cpu_runq;
+    e->env_rt_period = period;
+    e->env_rt_budget = budget;
+    e->env_rt_cpu = i;
+    e->env_rt_next = rq->rq_rt_list;
+    rq->rq_rt_list = e;
+    rq->rq_rt_util += util;
+    e->env_rt_deadline = read_tsc() + ((uint64_t)period << RT_TIME_SHIFT);
+    e->env_rt_used = 0;
+    e->env_rt_done = 0;
+    e->env_rt_ready = 0;
+    e->env_rt_jobs++;
+  }
+  if (queued)
+    sched_enqueue(e);
+  return 0;
+}
+
+// Restrict e to the CPUs in mask, moving it (and its real-time
+// reservation, if any) to an allowed CPU.  If e is running on another
+// CPU that it may no longer use, that CPU is told to give it up.
+// Returns 0 on success, -E_INVAL if mask contains no CPU, or
+// -E_NO_CPU if e's reservation does not fit on any CPU in mask.
+int
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+  uint32_t old = e->env_affinity;
+  int r;
+
+  if (!(mask & ((1 << ncpu) - 1)))
+    return -E_INVAL;
+  e->env_affinity = mask;
+  if (e->env_rt_period && !env_allowed(e, e->env_rt_cpu) &&
+      (r = sched_rt_reserve(e, e->env_rt_period, e->env_rt_budget)) < 0) {
+    e->env_affinity = old;
+    return r;
+  }
+  if (e->env_runq) {
+    sched_dequeue(e);
+    sched_enqueue(e);
+  }
+  if (e->env_status == ENV_RUNNING && e->env_cpunum != cpunum() &&
+      !env_allowed(e, e->env_cpunum))
+    sched_evict(e);
+  return 0;
+}
+
+void
+sched_evict(struct Env *e)
+{
+  cpu_kick(&cpus[e->env_cpunum]);
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
 //
@@ -71,6 +1334,22 @@ sched_halt(void)
 {
   int i;
 
+  // Mark that no environment is running on this CPU
+  if (curenv)
+    sched_switch(curenv, NULL);
+  curenv = NULL;
+  lcr3(PADDR(kern_pgdir));
+
+  // If the env we just left was dying, free it and look for work
+  // again.  Freeing it takes its env lock, which ranks before
+  // sched_lock.
+  if (thiscpu->cpu_zombie) {
+    unlock_sched();
+    env_reap();
+    lock_sched();
+    sched_yield();
+  }
+
   // For debugging and testing purposes, if there are no runnable
   // environments in the system, then drop into the kernel monitor.
   for (i = 0; i < NENV; i++) {
@@ -79,23 +1358,25 @@ sched_halt(void)
          envs[i].env_status == ENV_DYING))
       break;
   }
-  if (i == NENV) {
+  if (i == NENV && timer_next() == ~(uint64_t)0) {
     cprintf("No runnable environments in the system!\n");
     while (1)
       monitor(NULL);
   }
 
-  // Mark that no environment is running on this CPU
-  curenv = NULL;
-  lcr3(PADDR(kern_pgdir));
+  sched_timer_arm();
 
-  // Mark that this CPU is in the HALT state, so that when
-  // timer interupts come in, we know we should re-acquire the
-  // big kernel lock
+  // Mark that this CPU is in the HALT state.  sched_kick() checks
+  // this with sched_lock held, so no work queued for this CPU from
+  // here on can go unannounced.
+  thiscpu->cpu_kicked = 0;
   xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-  // Release the big kernel lock as if we were "leaving" the kernel
-  unlock_kernel();
+  // Release sched_lock as if we were "leaving" the kernel
+  unlock_sched();
+
+  // Spend some of the idle time zeroing pages for page_alloc.
+  page_zero_idle();
 
   // Reset stack pointer, enable interrupts and then halt.
   asm volatile (
@@ -108,5 +1389,6 @@ sched_halt(void)
     "hlt\n"
     "jmp 1b\n"
     : : "a" (thiscpu->cpu_ts.ts_esp0));
+  __builtin_unreachable();
 }
 
@@ -6,7 +6,136 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+struct Env;
+struct RunQueue;
+
+// A scheduling class implements one policy on the per-CPU run queues.
+// The generic code in sched.c keeps e->env_runq up to date and calls
+// into the class of each env: the real-time (EDF) class for envs with
+// a reservation, otherwise the best-effort class chosen at boot.
+struct sched_class {
+  const char *name;
+  uint32_t slice_us;    // Default time slice (microseconds), 0 for none
+  // Add e to (remove e from) run queue rq.
+  void (*enqueue)(struct RunQueue *rq, struct Env *e);
+  void (*dequeue)(struct RunQueue *rq, struct Env *e);
+  // The env on rq that should run next, without removing it, or NULL.
+  struct Env *(*pick_next)(struct RunQueue *rq);
+  // The queued env after e on rq (the first if e is NULL), or NULL,
+  // in queue order.  Used to look past envs that cannot be stolen;
+  // real-time envs never are, so the EDF class leaves it out.
+  struct Env *(*next)(struct RunQueue *rq, struct Env *e);
+  // Timer tick while cur runs on rq's CPU; true to preempt cur.
+  bool (*tick)(struct RunQueue *rq, struct Env *cur);
+  // Optional: e calls sys_yield.
+  void (*yield)(struct Env *e);
+  // Optional: cur hands its CPU to the queued env 'to' (sys_yield_to).
+  void (*yield_to)(struct Env *cur, struct Env *to);
+  // Optional: e was stolen from another CPU's queue for rq's CPU.
+  void (*migrate)(struct RunQueue *rq, struct Env *e);
+};
+
+// Best-effort scheduling policies
+enum {
+  SCHED_RR = 0,         // Round-robin
+  SCHED_SJF,            // Shortest job first (non-preemptive)
+  SCHED_SRTF,           // Shortest remaining time first
+  SCHED_CFS,            // Completely fair (weighted virtual runtime)
+  SCHED_STRIDE,         // Stride scheduling over ticket shares
+  SCHED_MLFQ,           // Multi-level feedback queue
+};
+
+// The policy is chosen at boot with a "sched=<name>" option on the
+// kernel command line (rr, sjf, srtf, cfs, stride or mlfq), and the
+// length of its time slice with "slice=<microseconds>", e.g.
+//   qemu-system-i386 -kernel obj/kern/kernel -append "sched=cfs slice=2000"
+// Without one it defaults to SCHED_POLICY, which can be set at build
+// time, e.g.
+//   make DEFS=-DSCHED_POLICY=SCHED_SRTF
+#ifndef SCHED_POLICY
+#define SCHED_POLICY SCHED_RR
+#endif
+
+extern const struct sched_class *sched_class;
+extern uint32_t sched_slice_us;
+
+// sched_lock protects all scheduler state, including every env's
+// env_status.  Except where noted, the functions below must be called
+// with it held.  env_run() releases it on the way to user mode, and
+// the functions that do not return release it the same way.
+extern struct spinlock sched_lock;
+
+static inline void
+lock_sched(void)
+{
+	spin_lock(&sched_lock);
+	// The trap return path must re-arm this CPU's timer.
+	thiscpu->cpu_sched_dirty = 1;
+}
+
+static inline void
+unlock_sched(void)
+{
+	spin_unlock(&sched_lock);
+}
+
+// Called once at boot, before any other CPU starts.
+void sched_init(const char *cmdline);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+// Called on every timer interrupt and reschedule IPI, without
+// sched_lock.  Return if the current env should keep running;
+// otherwise do not return.
+void sched_tick(void);
+void sched_ipi(void);
+
+// Called when e gives up the CPU with sys_yield.
+void sched_env_yield(struct Env *e);
+
+// Switch from curenv directly to 'to' if possible.  Does not return.
+void sched_yield_to(struct Env *to) __attribute__((noreturn));
+
+// Arm this CPU's timer, if needed, before leaving the kernel.
+void sched_timer_arm(void);
+
+// Per-env accounting when a CPU switches envs (see env_run).  Needs
+// no lock when prev == next.
+void sched_switch(struct Env *prev, struct Env *next);
+
+// Timed sleep (sys_sleep).
+void sched_sleep(struct Env *e, uint64_t nsec);
+void sched_sleep_cancel(struct Env *e);
+
+// Charge e for the CPU time it used since env_run().  Called without
+// sched_lock by the CPU running e.
+void sched_charge(struct Env *e);
+
+// Stride ticket loans from an env blocked in IPC to its peer.
+void sched_donate(struct Env *from, struct Env *to);
+void sched_revoke(struct Env *from);
+void sched_revoke_to(struct Env *to);
+
+// Real-time (EDF) reservations.  Each CPU may reserve up to
+// RT_UTIL_MAX / RT_UTIL_ONE of its time for real-time envs.
+#define RT_UTIL_ONE     1024
+#define RT_UTIL_MAX     (RT_UTIL_ONE * 9 / 10)
+
+int sched_rt_reserve(struct Env *e, uint32_t period, uint32_t budget);
+
+// CPU affinity (e->env_affinity).
+int sched_set_affinity(struct Env *e, uint32_t mask);
+
+// Make the CPU running e (not this one) switch away from it.
+void sched_evict(struct Env *e);
+
+// Run queue maintenance; called by env_set_status() on transitions
+// into and out of ENV_RUNNABLE.
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -9,13 +9,6 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-  .name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -34,21 +27,266 @@ get_caller_pcs(uint32_t pcs[])
   for (; i < 10; i++)
     pcs[i] = 0;
 }
+#endif
 
+#ifdef SPINLOCK_CHECK
 // Check whether this CPU is holding the lock.
 static int
 holding(struct spinlock *lock)
 {
-  return lock->locked && lock->cpu == thiscpu;
+  bool held;
+
+  switch (lock->kind) {
+  case SPIN_TICKET:
+    held = lock->next != lock->owner;
+    break;
+  case SPIN_MCS:
+    held = lock->tail != NULL;
+    break;
+  default:
+    held = lock->locked;
+  }
+  return held && lock->cpu == thiscpu;
+}
+
+// Check that this CPU may acquire lk without breaking the lock order
+// (see kern/spinlock.h), and add lk to the locks it holds.
+static void
+lock_order_acquire(struct spinlock *lk)
+{
+  struct CpuInfo *c = thiscpu;
+  struct spinlock *h;
+  int i;
+
+  for (i = 0; i < c->cpu_nlocks; i++) {
+    h = c->cpu_locks[i];
+    if (h->rank > lk->rank || (h->rank == lk->rank && h > lk))
+      panic("CPU %d cannot acquire %s while holding %s",
+            cpunum(), lk->name, h->name);
+  }
+  if (c->cpu_nlocks == CPU_MAXLOCKS)
+    panic("CPU %d cannot acquire %s: holding too many locks",
+          cpunum(), lk->name);
+  c->cpu_locks[c->cpu_nlocks++] = lk;
+}
+
+static void
+lock_order_release(struct spinlock *lk)
+{
+  struct CpuInfo *c = thiscpu;
+  int i;
+
+  for (i = 0; i < c->cpu_nlocks; i++)
+    if (c->cpu_locks[i] == lk) {
+      c->cpu_locks[i] = c->cpu_locks[--c->cpu_nlocks];
+      return;
+    }
 }
 #endif
 
+// Take the next ticket and wait for it to be served.
+// Returns whether we had to wait.
+static bool
+ticket_lock(struct spinlock *lk)
+{
+  uint32_t ticket = xadd(&lk->next, 1);
+
+  if (lk->owner == ticket)
+    return 0;
+  while (lk->owner != ticket)
+    asm volatile ("pause");
+  // Keep the critical section's reads after the loop.
+  asm volatile ("" : : : "memory");
+  return 1;
+}
+
+// Serve the next ticket.  Only the holder writes owner, so a plain
+// increment suffices; the xchg keeps the critical section before it,
+// as in the SPIN_TAS case of spin_unlock.
+static void
+ticket_unlock(struct spinlock *lk)
+{
+  xchg(&lk->owner, lk->owner + 1);
+}
+
+// Join the lock's queue with one of this CPU's nodes and wait for the
+// previous holder to hand the lock over.  A CPU needs a separate node
+// for each MCS lock it holds or waits for.  Returns whether we had to
+// wait.
+static bool
+mcs_lock(struct spinlock *lk)
+{
+  struct CpuInfo *c = thiscpu;
+  struct mcs_node *n, *pred;
+  int i;
+
+  for (i = 0; i < CPU_MAXLOCKS && (c->cpu_mcs_used & (1 << i)); i++)
+    /* do nothing */;
+  if (i == CPU_MAXLOCKS)
+    panic("CPU %d: out of MCS lock nodes", cpunum());
+  c->cpu_mcs_used |= 1 << i;
+  n = &c->cpu_mcs[i];
+
+  n->mn_next = NULL;
+  n->mn_wait = 1;
+  pred = (struct mcs_node *) xchg((volatile uint32_t *) &lk->tail,
+                                  (uint32_t) n);
+  if (pred) {
+    pred->mn_next = n;
+    while (n->mn_wait)
+      asm volatile ("pause");
+  }
+  asm volatile ("" : : : "memory");
+  lk->node = n;
+  return pred != NULL;
+}
+
+// Hand the lock to the next waiter, or mark it free if there is none.
+static void
+mcs_unlock(struct spinlock *lk)
+{
+  struct CpuInfo *c = thiscpu;
+  struct mcs_node *n = lk->node;
+
+  if (!n->mn_next) {
+    // No known successor: try to swing tail back to NULL.  If that
+    // fails, a new waiter is between its xchg and linking itself in.
+    if (cmpxchg((volatile uint32_t *) &lk->tail, (uint32_t) n, 0) ==
+        (uint32_t) n)
+      goto done;
+    while (!n->mn_next)
+      asm volatile ("pause");
+  }
+  xchg(&n->mn_next->mn_wait, 0);
+done:
+  c->cpu_mcs_used &= ~(1 << (n - c->cpu_mcs));
+}
+
+#ifdef SPINLOCK_STATS
+// Every lock acquired at least once, newest first.
+static struct spinlock *volatile lockstat_list;
+
+// Most distinct lock names lockstat_print() shows
+#define LOCKSTAT_NAMES  16
+
+// Account for an acquisition of lk that started at TSC time t0.
+// Called by the new holder.
+static void
+lockstat_acquired(struct spinlock *lk, uint64_t t0, bool contended)
+{
+  struct lockstat *ls = &lk->stat;
+  uint64_t now = t0, spin;
+
+  if (!ls->ls_listed) {
+    // Other CPUs may be adding other locks at the same time.
+    do
+      ls->ls_next = lockstat_list;
+    while (cmpxchg((volatile uint32_t *) &lockstat_list,
+                   (uint32_t) ls->ls_next, (uint32_t) lk) !=
+           (uint32_t) ls->ls_next);
+    ls->ls_listed = 1;
+  }
+
+  ls->ls_acquires++;
+  if (contended) {
+    now = read_tsc();
+    spin = now - t0;
+    ls->ls_contended++;
+    ls->ls_spin += spin;
+    if (spin > ls->ls_maxspin)
+      ls->ls_maxspin = spin;
+  }
+  ls->ls_since = now;
+}
+
+// Account for the end of the current holder's hold on lk.
+static void
+lockstat_released(struct spinlock *lk)
+{
+  struct lockstat *ls = &lk->stat;
+  uint64_t hold = read_tsc() - ls->ls_since;
+
+  ls->ls_hold += hold;
+  if (hold > ls->ls_maxhold)
+    ls->ls_maxhold = hold;
+}
+
+// Print the statistics of every lock that has been acquired, summing
+// locks with the same name (such as the env locks).
+void
+lockstat_print(void)
+{
+  static struct lockstat sums[LOCKSTAT_NAMES];
+  static const char *names[LOCKSTAT_NAMES];
+  struct spinlock *lk;
+  struct lockstat *s;
+  int i, n = 0;
+
+  for (lk = lockstat_list; lk; lk = lk->stat.ls_next) {
+    for (i = 0; i < n && strcmp(names[i], lk->name) != 0; i++)
+      /* do nothing */;
+    if (i == n) {
+      if (n == LOCKSTAT_NAMES)
+        continue;
+      names[n++] = lk->name;
+      memset(&sums[i], 0, sizeof(sums[i]));
+    }
+    s = &sums[i];
+    s->ls_acquires += lk->stat.ls_acquires;
+    s->ls_contended += lk->stat.ls_contended;
+    s->ls_spin += lk->stat.ls_spin;
+    s->ls_hold += lk->stat.ls_hold;
+    if (lk->stat.ls_maxspin > s->ls_maxspin)
+      s->ls_maxspin = lk->stat.ls_maxspin;
+    if (lk->stat.ls_maxhold > s->ls_maxhold)
+      s->ls_maxhold = lk->stat.ls_maxhold;
+  }
+
+  cprintf("%-14s %10s %10s %9s %9s %9s %9s\n", "lock", "acquires",
+          "contended", "avg spin", "max spin", "avg hold", "max hold");
+  for (i = 0; i < n; i++) {
+    s = &sums[i];
+    cprintf("%-14s %10llu %10llu %9llu %9llu %9llu %9llu\n", names[i],
+            s->ls_acquires, s->ls_contended,
+            s->ls_contended ? s->ls_spin / s->ls_contended : 0,
+            s->ls_maxspin,
+            s->ls_acquires ? s->ls_hold / s->ls_acquires : 0,
+            s->ls_maxhold);
+  }
+  cprintf("Spin and hold times in TSC cycles; avg spin is per "
+          "contended acquisition.\n");
+}
+
+// Zero the statistics of every lock.  Locks in use on other CPUs may
+// keep a count or two from before the reset.
 void
-__spin_initlock(struct spinlock *lk, char *name)
+lockstat_reset(void)
 {
+  struct spinlock *lk;
+  struct lockstat *ls;
+
+  for (lk = lockstat_list; lk; lk = ls->ls_next) {
+    ls = &lk->stat;
+    ls->ls_acquires = ls->ls_contended = 0;
+    ls->ls_spin = ls->ls_maxspin = 0;
+    ls->ls_hold = ls->ls_maxhold = 0;
+  }
+}
+#endif
+
+void
+__spin_initlock(struct spinlock *lk, char *name, int rank, int kind)
+{
+  lk->kind = kind;
   lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+  lk->next = lk->owner = 0;
+  lk->tail = lk->node = NULL;
   lk->name = name;
+#ifdef SPINLOCK_STATS
+  memset(&lk->stat, 0, sizeof(lk->stat));
+#endif
+#ifdef SPINLOCK_CHECK
+  lk->rank = rank;
   lk->cpu = 0;
 #endif
 }
@@ -60,20 +298,43 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
-#ifdef DEBUG_SPINLOCK
+#ifdef SPINLOCK_CHECK
   if (holding(lk))
     panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+  lock_order_acquire(lk);
+#endif
+#ifdef SPINLOCK_STATS
+  uint64_t t0 = read_tsc();
 #endif
+  bool contended;
 
-  // The xchg is atomic.
-  // It also serializes, so that reads after acquire are not
-  // reordered before it.
-  while (xchg(&lk->locked, 1) != 0)
-    asm volatile ("pause");
+  switch (lk->kind) {
+  case SPIN_TICKET:
+    contended = ticket_lock(lk);
+    break;
+  case SPIN_MCS:
+    contended = mcs_lock(lk);
+    break;
+  default:
+    // The xchg is atomic.
+    // It also serializes, so that reads after acquire are not
+    // reordered before it.
+    contended = 0;
+    while (xchg(&lk->locked, 1) != 0) {
+      contended = 1;
+      asm volatile ("pause");
+    }
+  }
+
+#ifdef SPINLOCK_STATS
+  lockstat_acquired(lk, t0, contended);
+#endif
 
   // Record info about lock acquisition for debugging.
-#ifdef DEBUG_SPINLOCK
+#ifdef SPINLOCK_CHECK
   lk->cpu = thiscpu;
+#endif
+#ifdef DEBUG_SPINLOCK
   get_caller_pcs(lk->pcs);
 #endif
 }
@@ -82,14 +343,16 @@ spin_lock(struct spinlock *lk)
 void
 spin_unlock(struct spinlock *lk)
 {
-#ifdef DEBUG_SPINLOCK
+#ifdef SPINLOCK_CHECK
   if (!holding(lk)) {
+    cprintf("CPU %d cannot release %s: held by CPU %d\n",
+            cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
+#ifdef DEBUG_SPINLOCK
     int i;
     uint32_t pcs[10];
     // Nab the acquiring EIP chain before it gets released
     memmove(pcs, lk->pcs, sizeof pcs);
-    cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:",
-            cpunum(), lk->name, lk->cpu->cpu_id);
+    cprintf("Acquired at:");
     for (i = 0; i < 10 && pcs[i]; i++) {
       struct Eipdebuginfo info;
       if (debuginfo_eip(pcs[i], &info) >= 0)
@@ -100,21 +363,73 @@ spin_unlock(struct spinlock *lk)
       else
         cprintf("  %08x\n", pcs[i]);
     }
+#endif
     panic("spin_unlock");
   }
 
+#ifdef DEBUG_SPINLOCK
   lk->pcs[0] = 0;
+#endif
   lk->cpu = 0;
+  lock_order_release(lk);
 #endif
+#ifdef SPINLOCK_STATS
+  lockstat_released(lk);
+#endif
+
+  switch (lk->kind) {
+  case SPIN_TICKET:
+    ticket_unlock(lk);
+    break;
+  case SPIN_MCS:
+    mcs_unlock(lk);
+    break;
+  default:
+    // The xchg serializes, so that reads before release are
+    // not reordered after it.  The 1996 PentiumPro manual (Volume 3,
+    // 7.2) says reads can be carried out speculatively and in
+    // any order, which implies we need to serialize here.
+    // But the 2007 Intel 64 Architecture Memory Ordering White
+    // Paper says that Intel 64 and IA-32 will not move a load
+    // after a store. So lock->locked = 0 would work here.
+    // The xchg being asm volatile ensures gcc emits it after
+    // the above assignments (and after the critical section).
+    xchg(&lk->locked, 0);
+  }
+}
+
+// Locks used only by spin_bench, one of each kind.
+static struct spinlock bench_locks[NSPINKINDS] = {
+  [SPIN_TAS] = SPINLOCK_INIT(bench_tas, LOCK_RANK_BENCH, SPIN_TAS),
+  [SPIN_TICKET] = SPINLOCK_INIT(bench_ticket, LOCK_RANK_BENCH, SPIN_TICKET),
+  [SPIN_MCS] = SPINLOCK_INIT(bench_mcs, LOCK_RANK_BENCH, SPIN_MCS),
+};
+static volatile uint32_t bench_count;
 
-  // The xchg serializes, so that reads before release are
-  // not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-  // 7.2) says reads can be carried out speculatively and in
-  // any order, which implies we need to serialize here.
-  // But the 2007 Intel 64 Architecture Memory Ordering White
-  // Paper says that Intel 64 and IA-32 will not move a load
-  // after a store. So lock->locked = 0 would work here.
-  // The xchg being asm volatile ensures gcc emits it after
-  // the above assignments (and after the critical section).
-  xchg(&lk->locked, 0);
+// Lock benchmark (sys_lock_bench).  Wait until TSC time start, then
+// acquire and release the benchmark lock of the given kind until TSC
+// time end, holding it each time for a short critical section.
+// Record in lb how often this CPU got the lock and how long it waited.
+// Run on several CPUs at once to measure the lock under contention.
+void
+spin_bench(int kind, uint64_t start, uint64_t end, struct LockBench *lb)
+{
+  struct spinlock *lk = &bench_locks[kind];
+  uint64_t t0, wait;
+
+  lb->lb_acquires = 0;
+  lb->lb_wait = lb->lb_maxwait = 0;
+  while (read_tsc() < start)
+    asm volatile ("pause");
+  while ((t0 = read_tsc()) < end) {
+    spin_lock(lk);
+    wait = read_tsc() - t0;
+    bench_count++;
+    spin_unlock(lk);
+
+    lb->lb_acquires++;
+    lb->lb_wait += wait;
+    if (wait > lb->lb_maxwait)
+      lb->lb_maxwait = wait;
+  }
 }
@@ -2,47 +2,126 @@
 #define JOS_INC_SPINLOCK_H
 
 #include <inc/types.h>
+#include <inc/syscall.h>
 
-// Comment this to disable spinlock debugging
-#define DEBUG_SPINLOCK
+// Comment this to disable lock checking: spin_lock() panics on an
+// acquisition that breaks the lock order below or takes a lock this
+// CPU already holds, and spin_unlock() on releasing a lock this CPU
+// does not hold.  It costs a scan of the few locks the CPU holds.
+#define SPINLOCK_CHECK
+
+// Uncomment this to also record a call stack for each held lock, for
+// spin_unlock() to print when its check fails.  Recording the call
+// stack walks the %ebp chain on every acquisition, so this is off by
+// default.
+//#define DEBUG_SPINLOCK
+
+#if defined(DEBUG_SPINLOCK) && !defined(SPINLOCK_CHECK)
+#define SPINLOCK_CHECK
+#endif
+
+// Comment this to disable lock contention statistics (see lockstat)
+#define SPINLOCK_STATS
+
+// Kernel locks and their order.  A CPU may acquire a lock only if its
+// rank is higher than that of every lock the CPU already holds, or
+// equal to it and the lock is at a higher address (so two env locks
+// are taken in envs[] order, see env_lock_pair).  With SPINLOCK_CHECK,
+// spin_lock() panics on any acquisition that breaks this order.
+//
+//   env_lock(e)  per-env: e's address space and IPC state, and keeps
+//                e from being freed (kern/env.c)
+//   sched_lock   env_status, run queues, the env free list, timers and
+//                all other scheduler state (kern/sched.c)
+//   kc_lock      per-cache: a kmem cache's slabs; kmem_lock: the list
+//                of caches (kern/kmalloc.c)
+//   pm_lock      per-CPU: a CPU's page magazine (kern/pmap.c)
+//   page_lock    the physical page free list and pp_ref (kern/pmap.c)
+//   cons_lock    console input and output (kern/console.c)
+//   bench_locks  only taken by sys_lock_bench (kern/spinlock.c)
+enum {
+	LOCK_RANK_ENV = 1,
+	LOCK_RANK_SCHED,
+	LOCK_RANK_KMEM,
+	LOCK_RANK_MAG,
+	LOCK_RANK_PAGE,
+	LOCK_RANK_CONS,
+	LOCK_RANK_BENCH,
+};
+
+// Each lock has one of three implementations (SPIN_* in inc/syscall.h),
+// chosen when it is initialized:
+//
+//   SPIN_TAS     test-and-set: every waiter spins with xchg on the lock
+//                word, and whoever gets there first after a release wins.
+//   SPIN_TICKET  waiters take a ticket with one atomic add and spin
+//                reading the ticket being served; FIFO, but every
+//                release still invalidates every waiter's cache line.
+//   SPIN_MCS     waiters queue on per-CPU nodes and each spins on its
+//                own node, which its predecessor writes on release;
+//                FIFO with one cache line transfer per handoff.
+
+// A CPU's place in the queue of an SPIN_MCS lock.
+struct mcs_node {
+	struct mcs_node *volatile mn_next;  // Next waiter in the queue
+	volatile uint32_t mn_wait;          // Cleared by our predecessor
+};
+
+// Contention statistics for one lock, in TSC cycles.  Only the lock's
+// holder updates them, so they need no atomic operations.  Costs two
+// rdtsc per acquire/release pair, three if the acquire had to wait.
+struct lockstat {
+	uint64_t ls_acquires;           // Times acquired
+	uint64_t ls_contended;          // Acquisitions that had to wait
+	uint64_t ls_spin;               // Total cycles spent waiting
+	uint64_t ls_maxspin;            // Longest wait
+	uint64_t ls_hold;               // Total cycles held
+	uint64_t ls_maxhold;            // Longest hold
+	uint64_t ls_since;              // When the holder got the lock
+	struct spinlock *ls_next;       // Next lock on the lockstat list
+	bool ls_listed;                 // On the list yet?
+};
 
 // Mutual exclusion lock.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	int kind;                       // SPIN_TAS, SPIN_TICKET or SPIN_MCS
+	volatile uint32_t locked;       // SPIN_TAS: is the lock held?
+	volatile uint32_t next;         // SPIN_TICKET: next ticket to take
+	volatile uint32_t owner;        // SPIN_TICKET: ticket now served
+	struct mcs_node *volatile tail; // SPIN_MCS: last waiter, or NULL
+	struct mcs_node *node;          // SPIN_MCS: the holder's node
+	char *name;                     // Name of lock.
 
-#ifdef DEBUG_SPINLOCK
-	// For debugging:
-	char *name;            // Name of lock.
+#ifdef SPINLOCK_STATS
+	struct lockstat stat;
+#endif
+
+#ifdef SPINLOCK_CHECK
+	int rank;              // Position in the lock order (LOCK_RANK_*)
 	struct CpuInfo *cpu;   // The CPU holding the lock.
+#endif
+#ifdef DEBUG_SPINLOCK
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock(struct spinlock *lk, char *name, int rank, int kind);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_bench(int kind, uint64_t start, uint64_t end, struct LockBench *lb);
+void lockstat_print(void);
+void lockstat_reset(void);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
+#define spin_initlock(lock, rank, kind) \
+	__spin_initlock(lock, #lock, rank, kind)
 
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// Static initializer for a lock of the given rank and kind.
+#ifdef SPINLOCK_CHECK
+#define SPINLOCK_INIT(lock, rnk, knd) \
+	{ .kind = (knd), .name = #lock, .rank = (rnk) }
+#else
+#define SPINLOCK_INIT(lock, rnk, knd)    { .kind = (knd), .name = #lock }
+#endif
 
 #endif
@@ -11,6 +11,7 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/time.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -22,9 +23,12 @@ sys_cputs(const char *s, size_t len)
   // Destroy the environment if not.
 
   // LAB 3: Your code here.
+  if (user_mem_lock(curenv, s, len, 0) < 0)
+    return;
 
   // Print the string supplied by the user.
   cprintf("%.*s", len, s);
+  env_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -53,7 +57,7 @@ sys_env_destroy(envid_t envid)
   int r;
   struct Env *e;
 
-  if ((r = envid2env(envid, &e, 1)) < 0)
+  if ((r = envid2env_lock(envid, &e, 1)) < 0)
     return r;
   if (e == curenv)
     cprintf("[%08x] exiting gracefully\n", curenv->env_id);
@@ -67,6 +71,8 @@ sys_env_destroy(envid_t envid)
 static void
 sys_yield(void)
 {
+  lock_sched();
+  sched_env_yield(curenv);
   sched_yield();
 }
 
@@ -78,20 +84,24 @@ static envid_t
 sys_exofork(void)
 {
   // Create the new environment with env_alloc(), from kern/env.c.
-  // It should be left as env_alloc created it, except that
-  // status is set to ENV_NOT_RUNNABLE, and the register set is copied
-  // from the current environment -- but tweaked so sys_exofork
-  // will appear to return 0.
+  // It should be left as env_alloc created it (ENV_NOT_RUNNABLE),
+  // except that the register set is copied from the current
+  // environment -- but tweaked so sys_exofork will appear to return 0.
 
   // LAB 4: Your code here.
   struct Env* env;
+  lock_sched();
   int ret = env_alloc(&env,ENVX(curenv->env_id));
+  unlock_sched();
   if(ret < 0)
     return ret;
-  env->env_status = ENV_NOT_RUNNABLE;
   env->env_tf = curenv->env_tf;
   env->env_tf.tf_regs.reg_eax = 0;
   env->env_parent_id = curenv->env_id;
+  env->env_weight = curenv->env_weight;
+  env->env_tickets = curenv->env_tickets;
+  env->env_affinity = curenv->env_affinity;
+  env->env_gang = curenv->env_gang;
   return env->env_id;
 }
 
@@ -112,12 +122,19 @@ sys_env_set_status(envid_t envid, int status)
   // envid's status.
 
   // LAB 4: Your code here.
-  if(status>4 || status<0)return -E_INVAL;
+  if(status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
+    return -E_INVAL;
   struct Env* env;
-  if(envid2env(envid,&env,1)<0) return -E_BAD_ENV;
-  env->env_status = status;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  // A running env is already runnable; it stays on its CPU.
+  if(!(env->env_status == ENV_RUNNING && status == ENV_RUNNABLE))
+    env_set_status(env, status);
+  unlock_sched();
   return 0;
-  panic("sys_env_set_status not implemented");
 }
 
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
@@ -133,10 +150,10 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
   // LAB 4: Your code here.
   struct Env* env;
-  if(envid2env(envid,&env,1)<0) return -E_BAD_ENV;
+  if(envid2env_lock(envid,&env,1)<0) return -E_BAD_ENV;
   env->env_pgfault_upcall = func;
+  env_unlock(env);
   return 0;
-  panic("sys_env_set_pgfault_upcall not implemented");
 }
 
 // Allocate a page of memory and map it at 'va' with permission
@@ -147,11 +164,16 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may also be set, to allocate a 4MB large page of
+//         physically contiguous memory instead; it replaces whatever
+//         was mapped in the 4MB at va.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if (perm & PTE_PS) and va is not PTSIZE-aligned.
+//	-E_INVAL if va is inside a 4MB page and perm lacks PTE_PS.
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
@@ -167,24 +189,35 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
   // LAB 4: Your code here.
   struct Env* env;
-  
-  if(envid2env(envid,&env,1)<0) 
-    return -E_BAD_ENV;
 
   if(va >= (void*)UTOP || va!=ROUNDDOWN(va,PGSIZE)) 
     return -E_INVAL;
 
-  if(!(perm&PTE_P) || !(perm&PTE_U) || (perm & ~PTE_SYSCALL)) 
+  if(!(perm&PTE_P) || !(perm&PTE_U) || (perm & ~(PTE_SYSCALL|PTE_PS))) 
     return -E_INVAL;
+  int order = 0;
+  if(perm & PTE_PS){
+    if(va != ROUNDDOWN(va, PTSIZE))
+      return -E_INVAL;
+    order = PAGE_LARGE_ORDER;
+  }
 
-  struct PageInfo* page = page_alloc(ALLOC_ZERO);
+  // Zero the page before taking the env lock.
+  struct PageInfo* page = page_alloc_order(order, ALLOC_ZERO);
   if(page == NULL) 
     return -E_NO_MEM;
-  
-  if(page_insert(env->env_pgdir,page,va,perm|PTE_U)<0){
-    page_free(page);
-    return -E_NO_MEM;
+
+  if(envid2env_lock(envid,&env,1)<0){
+    page_free_order(page, order);
+    return -E_BAD_ENV;
+  }
+  int r;
+  if((r = page_insert(env->env_pgdir,page,va,perm|PTE_U))<0){
+    env_unlock(env);
+    page_free_order(page, order);
+    return r;
   }
+  env_unlock(env);
   return 0;
 }
 
@@ -203,7 +236,13 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a 4MB page and srcva or dstva is not
+//		PTSIZE-aligned.
+//	-E_INVAL if srcva is a 4K page and dstva is inside a 4MB page.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//
+// If srcva is in a 4MB page (see sys_page_alloc), the whole 4MB page is
+// mapped at dstva, whether or not perm includes PTE_PS.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
              envid_t dstenvid, void *dstva, int perm)
@@ -218,42 +257,57 @@ sys_page_map(envid_t srcenvid, void *srcva,
   // LAB 4: Your code here.
   struct Env* srcenv;
   struct Env* dstenv;
-  if(envid2env(srcenvid,&srcenv,1)<0) 
-    return -E_BAD_ENV;
-  if(envid2env(dstenvid,&dstenv,1)<0) 
-    return -E_BAD_ENV;
+  int r;
 
   if(srcva >= (void*)UTOP || srcva!=ROUNDUP(srcva,PGSIZE))
     return -E_INVAL;
   if(dstva >= (void*)UTOP || dstva!=ROUNDUP(dstva,PGSIZE))
     return -E_INVAL;
 
-  if(perm & ~PTE_SYSCALL)
+  if(perm & ~(PTE_SYSCALL|PTE_PS))
     return -E_INVAL;
 
+  if(envid2env(srcenvid,&srcenv,1)<0) 
+    return -E_BAD_ENV;
+  if(envid2env(dstenvid,&dstenv,1)<0) 
+    return -E_BAD_ENV;
+  env_lock_pair(srcenv, dstenv);
+  if(!env_valid(srcenv, srcenvid) || !env_valid(dstenv, dstenvid)){
+    r = -E_BAD_ENV;
+    goto out;
+  }
+
   pte_t* srcpte;
   struct PageInfo* srcpage=page_lookup(srcenv->env_pgdir,srcva,&srcpte);
-  if(srcpage==NULL)
-    return -E_INVAL;
-
-  if(perm&PTE_W && (*srcpte & PTE_W)==0)
-    return -E_INVAL;
-
-  if(page_insert(dstenv->env_pgdir,srcpage,dstva,perm)<0){
-    cprintf("E_NO_MEM\n");
-    return -E_NO_MEM;
+  if(srcpage==NULL || (perm&PTE_W && (*srcpte & PTE_W)==0)){
+    r = -E_INVAL;
+    goto out;
+  }
+  perm &= ~PTE_PS;
+  if(*srcpte & PTE_PS){
+    if(srcva != ROUNDDOWN(srcva, PTSIZE) || dstva != ROUNDDOWN(dstva, PTSIZE)){
+      r = -E_INVAL;
+      goto out;
+    }
+    perm |= PTE_PS;
   }
 
-  return 0;
+  r = page_insert(dstenv->env_pgdir,srcpage,dstva,perm);
+
+out:
+  env_unlock_pair(srcenv, dstenv);
+  return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
-// If no page is mapped, the function silently succeeds.
+// If no page is mapped, the function silently succeeds.  A 4MB page is
+// unmapped, all of it, at its first address.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is inside a 4MB page but not its first address.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -261,14 +315,18 @@ sys_page_unmap(envid_t envid, void *va)
 
   // LAB 4: Your code here.
   struct Env* env;
-  if(envid2env(envid,&env,1)<0) 
-    return -E_BAD_ENV;
   if(va >= (void*)UTOP || va!=ROUNDUP(va,PGSIZE))
     return -E_INVAL;
+  if(envid2env_lock(envid,&env,1)<0) 
+    return -E_BAD_ENV;
 
+  if((env->env_pgdir[PDX(va)] & PTE_PS) && va != ROUNDDOWN(va, PTSIZE)){
+    env_unlock(env);
+    return -E_INVAL;
+  }
   page_remove(env->env_pgdir,va);
+  env_unlock(env);
   return 0;
-  panic("sys_page_unmap not implemented");
 }
 
 // Try to send 'value' to the target env 'envid'.
@@ -314,14 +372,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
   // LAB 4: Your code here.
   struct Env *env;
-  if (envid2env(envid, &env, 0)) {
-    return -E_BAD_ENV;
-  }
-  //cprintf("sys_ipc_try_send: env:%08x value: %d\n",envid,value);
-
-  if(env->env_ipc_recving == 0){
-    return -E_IPC_NOT_RECV;
-  }
+  int r = 0;
 
   if((uintptr_t)srcva < UTOP){
     if(srcva != ROUNDDOWN(srcva,PGSIZE)){
@@ -331,21 +382,43 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     if(!(perm&PTE_P) || !(perm&PTE_U) || (perm&~PTE_SYSCALL)){
       return -E_INVAL;
     }
+  }
+
+  if (envid2env(envid, &env, 0)) {
+    return -E_BAD_ENV;
+  }
+  //cprintf("sys_ipc_try_send: env:%08x value: %d\n",envid,value);
+
+  // The receiver's lock keeps its recving flag and dstva stable, and
+  // ours keeps srcva mapped while we share it.
+  env_lock_pair(curenv, env);
+  if(!env_valid(env, envid)){
+    r = -E_BAD_ENV;
+    goto out;
+  }
+
+  if(env->env_ipc_recving == 0){
+    // The receiver is busy.  Lend it our stride tickets while we
+    // retry, so it gets through its work on our behalf sooner.
+    lock_sched();
+    sched_donate(curenv, env);
+    unlock_sched();
+    r = -E_IPC_NOT_RECV;
+    goto out;
+  }
 
+  if((uintptr_t)srcva < UTOP){
     pte_t* pte;
     struct PageInfo* page = page_lookup(curenv->env_pgdir,srcva,&pte);
-    if(page == NULL){
-      return -E_INVAL;
-    }
-
-    if((perm&PTE_W) && !(*pte&PTE_W)){
-      return -E_INVAL;
+    // 4MB pages are shared with sys_page_map, not sent.
+    if(page == NULL || ((perm&PTE_W) && !(*pte&PTE_W)) || (*pte&PTE_PS)){
+      r = -E_INVAL;
+      goto out;
     }
 
     if((uintptr_t)env->env_ipc_dstva < UTOP &&
-          page_insert(env->env_pgdir,page,env->env_ipc_dstva,perm) < 0){
-      return -E_NO_MEM;
-    }
+          (r = page_insert(env->env_pgdir,page,env->env_ipc_dstva,perm)) < 0)
+      goto out;
     env->env_ipc_perm = perm;
   }else{
     env->env_ipc_perm = 0;
@@ -355,9 +428,24 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
   env->env_ipc_from = curenv->env_id;
   //cprintf("VALUE: %d\n",value);
   env->env_ipc_value = value;
-  env->env_status = ENV_RUNNABLE;
 
-  return 0;
+  lock_sched();
+  env_set_status(env, ENV_RUNNABLE);
+
+  // Both sides are done waiting: end any ticket loans.  If the
+  // receiver was waiting on us, this is its reply; otherwise it is a
+  // request, and we now wait on the receiver for ours.
+  sched_revoke(curenv);
+  sched_revoke(env);
+  unlock_sched();
+  if(env->env_ipc_to == curenv->env_id)
+    env->env_ipc_to = 0;
+  else
+    curenv->env_ipc_to = env->env_id;
+
+out:
+  env_unlock_pair(curenv, env);
+  return r;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -374,25 +462,336 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 static int
 sys_ipc_recv(void *dstva)
 {
-  if((uintptr_t)dstva < UTOP){
-    if(dstva != ROUNDDOWN(dstva,PGSIZE)){
-      return -E_INVAL;
-    }
-    curenv->env_ipc_dstva = dstva;
-  }else{
-    curenv->env_ipc_dstva = (void*)UTOP;
+  if((uintptr_t)dstva < UTOP && dstva != ROUNDDOWN(dstva,PGSIZE)){
+    return -E_INVAL;
   }
+
+  // Publish the receive under our own lock, and block under
+  // sched_lock before dropping it, so that a sender that sees
+  // env_ipc_recving cannot make us runnable before we block.
+  env_lock(curenv);
+  curenv->env_ipc_dstva = (uintptr_t)dstva < UTOP ? dstva : (void*)UTOP;
   //cprintf("env %08x setting to recv\n",curenv->env_id);
 
   curenv->env_ipc_recving = 1;
-  curenv->env_status = ENV_NOT_RUNNABLE;
+  lock_sched();
+  env_set_status(curenv, ENV_NOT_RUNNABLE);
+  env_unlock(curenv);
+
+  // If we sent a request that has not been answered yet, the env we
+  // sent it to is computing our reply; lend it our stride tickets
+  // while we are blocked.
+  struct Env *peer;
+  if(curenv->env_ipc_to && envid2env(curenv->env_ipc_to, &peer, 0) == 0)
+    sched_donate(curenv, peer);
+
+  curenv->env_tf.tf_regs.reg_eax = 0;
+
+  sched_yield();
+}
+
+// Declare envid's estimated runtime, in units of 1 << ESTRUNTIME_SHIFT
+// TSC cycles, for the SJF and SRTF scheduling policies.  An estimate
+// of 0 means "unknown"; such envs run after all envs with estimates.
+// CPU time already consumed by envid counts against the estimate.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_runtime(envid_t envid, uint32_t est)
+{
+  struct Env* env;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  env->estRunTime = est;
+  unlock_sched();
+  return 0;
+}
+
+// Set envid's CPU share weight for the SCHED_CFS policy.  Under CFS
+// each runnable env receives CPU time in proportion to its weight;
+// ENV_WEIGHT_DEFAULT is the weight of an ordinary env.  Children
+// created by sys_exofork inherit their parent's weight.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if weight is outside [ENV_WEIGHT_MIN, ENV_WEIGHT_MAX].
+static int
+sys_env_set_weight(envid_t envid, uint32_t weight)
+{
+  struct Env* env;
+  if(weight < ENV_WEIGHT_MIN || weight > ENV_WEIGHT_MAX)
+    return -E_INVAL;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  env->env_weight = weight;
+  unlock_sched();
+  return 0;
+}
+
+// Set the number of stride-scheduling tickets envid holds.  Under
+// SCHED_STRIDE each runnable env receives CPU time in proportion to
+// its tickets.  Children created by sys_exofork inherit their parent's
+// tickets.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if tickets is 0 or greater than ENV_TICKETS_MAX.
+static int
+sys_env_set_tickets(envid_t envid, uint32_t tickets)
+{
+  struct Env* env;
+  if(tickets == 0 || tickets > ENV_TICKETS_MAX)
+    return -E_INVAL;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  // Re-lend at the new amount so the borrower's count stays exact.
+  envid_t donee = env->env_donee;
+  struct Env* to;
+  sched_revoke(env);
+  env->env_tickets = tickets;
+  if(donee && envid2env(donee,&to,0) == 0)
+    sched_donate(env,to);
+  unlock_sched();
+  return 0;
+}
+
+// Give envid a real-time reservation of 'budget' units of CPU time in
+// every 'period' (both in 1 << RT_TIME_SHIFT TSC cycles), replacing
+// any earlier reservation.  Each period's job must finish by the end
+// of the period; the env signals that it has finished by calling
+// sys_yield, and is not run again until its next period starts.
+// Real-time envs are scheduled earliest-deadline-first ahead of all
+// other envs, and may not use more than their budget per period.
+// A period of 0 cancels the reservation.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if budget is 0 or greater than period.
+//	-E_NO_CPU if no CPU has enough unreserved capacity left.
+static int
+sys_env_set_rt(envid_t envid, uint32_t period, uint32_t budget)
+{
+  struct Env* env;
+  int r;
+  if(period && (budget == 0 || budget > period))
+    return -E_INVAL;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  r = sched_rt_reserve(env, period, budget);
+  unlock_sched();
+  return r;
+}
+
+// Restrict envid to run only on the CPUs in mask (bit i for CPU i).
+// A real-time env's reservation moves to an allowed CPU if necessary.
+// The affinity is inherited by children created with sys_exofork.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask contains no CPU present in the system.
+//	-E_NO_CPU if the env's real-time reservation fits on none of
+//		the CPUs in mask.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+  struct Env* env;
+  int r;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  if((r = sched_set_affinity(env, mask)) < 0){
+    unlock_sched();
+    return r;
+  }
+  // Leave this CPU now if the caller may no longer run on it.
+  if(env == curenv && !(mask & (1 << cpunum()))){
+    curenv->env_tf.tf_regs.reg_eax = 0;
+    sched_env_yield(curenv);
+    sched_yield();
+  }
+  unlock_sched();
+  return 0;
+}
+
+// Make envid a member of the gang named by the envid 'gang', or take
+// it out of its gang if gang is 0.  The members of a gang are
+// co-scheduled across CPUs (see kern/sched.c).  A gang is named after
+// an env the caller may manipulate, usually the parent of a parallel
+// job; the gang lives on after that env exits.  Children created with
+// sys_exofork inherit their parent's gang.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid or gang doesn't currently exist,
+//		or the caller doesn't have permission to change it.
+static int
+sys_env_set_gang(envid_t envid, envid_t gang)
+{
+  struct Env *env, *leader;
+  bool queued;
+  lock_sched();
+  if(envid2env(envid,&env,1)<0 ||
+     (gang && envid2env(gang,&leader,1)<0)){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  // Move a queued env to its new gang's list of queued members.
+  if((queued = (env->env_runq != NULL)))
+    sched_dequeue(env);
+  env->env_gang = gang ? leader->env_id : 0;
+  if(queued)
+    sched_enqueue(env);
+  unlock_sched();
+  return 0;
+}
+
+// Block the current environment for at least nsec nanoseconds.
+// The env is marked ENV_NOT_RUNNABLE and made runnable again by a
+// kernel timer; making it runnable by other means ends the sleep early.
+// Returns 0.
+static int
+sys_sleep(uint64_t nsec)
+{
+  if(nsec == 0)
+    return 0;
+  lock_sched();
+  sched_sleep(curenv, nsec);
+  curenv->env_tf.tf_regs.reg_eax = 0;
+  sched_yield();
+}
+
+// Store the time since boot, in nanoseconds, at *nsec.
+// Returns 0.  Destroys the environment if nsec is not writable.
+static int
+sys_time_nsec(uint64_t *nsec)
+{
+  if(user_mem_lock(curenv, nsec, sizeof(*nsec), PTE_W) < 0)
+    return -E_FAULT;
+  *nsec = time_nsec();
+  env_unlock(curenv);
+  return 0;
+}
 
+// Give up the CPU to envid, which runs next on this CPU for the rest
+// of the caller's time slice, if it is runnable and allowed to run
+// here.  Otherwise behaves like sys_yield.  Useful for handing off
+// to the other side of a request/reply exchange.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_yield_to(envid_t envid)
+{
+  struct Env* env;
+  lock_sched();
+  if(envid2env(envid,&env,0)<0){
+    unlock_sched();
+    return -E_BAD_ENV;
+  }
+  sched_env_yield(curenv);
   curenv->env_tf.tf_regs.reg_eax = 0;
+  sched_yield_to(env);
+}
+
+// Benchmark the kernel's spin lock implementations.  From kernel
+// clock time lb->lb_start until lb->lb_end, acquire and release a lock
+// of the given kind (SPIN_* in inc/syscall.h) that all CPUs share, then
+// fill in lb's results for this CPU.  Run one env per CPU over the
+// same times to measure the lock under contention.  The CPU does
+// nothing else until the run ends, with interrupts off, so the run
+// must end within LOCK_BENCH_MAX_NSEC of the call, and the caller must
+// be pinned to the CPU it is running on: it only ever holds up the
+// CPU it asked for.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if kind is not a lock kind, the run ends more than
+//		LOCK_BENCH_MAX_NSEC from now, or curenv's affinity
+//		allows any CPU other than this one.
+//	-E_FAULT if lb is not writable (the env is also destroyed).
+static int
+sys_lock_bench(int kind, struct LockBench *lb)
+{
+  struct LockBench b;
+  uint64_t now, start, end;
+
+  if(kind < 0 || kind >= NSPINKINDS)
+    return -E_INVAL;
+  if(curenv->env_affinity != (1U << cpunum()))
+    return -E_INVAL;
+  if(user_mem_lock(curenv, lb, sizeof(*lb), PTE_W) < 0)
+    return -E_FAULT;
+  b = *lb;
+  env_unlock(curenv);
+
+  now = time_nsec();
+  if(b.lb_start < now)
+    b.lb_start = now;
+  if(b.lb_end < b.lb_start || b.lb_end - now > LOCK_BENCH_MAX_NSEC)
+    return -E_INVAL;
 
-  sys_yield();
+  start = read_tsc() + nsec_to_tsc(b.lb_start - now);
+  end = start + nsec_to_tsc(b.lb_end - b.lb_start);
+  spin_bench(kind, start, end, &b);
+
+  if(user_mem_lock(curenv, lb, sizeof(*lb), PTE_W) < 0)
+    return -E_FAULT;
+  *lb = b;
+  env_unlock(curenv);
   return 0;
 }
 
+// Handle the system call in tf at once if it is one of the few that
+// only read the caller's own state or poll the console: these cannot
+// block, reschedule or destroy the caller, so trap() can return
+// straight to the env on the trap-time frame, skipping the trapframe
+// copy into curenv and the scheduler's bookkeeping.  The env is still
+// charged for its user time up to the trap, and trap() counts the
+// call itself as kernel time.
+// Stores the result in tf and returns 1 if it handled the call,
+// otherwise returns 0 and leaves tf alone.
+bool
+syscall_fast(struct Trapframe *tf)
+{
+  struct PushRegs *regs = &tf->tf_regs;
+
+  // An env being destroyed by another CPU must take the slow path
+  // to die.
+  if (!curenv || curenv->env_status != ENV_RUNNING)
+    return 0;
+
+  switch (regs->reg_eax) {
+  case SYS_getenvid:
+    sched_charge(curenv);
+    regs->reg_eax = sys_getenvid();
+    return 1;
+  case SYS_cgetc:
+    sched_charge(curenv);
+    regs->reg_eax = sys_cgetc();
+    return 1;
+  default:
+    return 0;
+  }
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -403,7 +802,6 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 
   switch (syscallno) {
   case SYS_cputs:
-    user_mem_assert(curenv,(void*)a1,a2,0);
     sys_cputs((char*)a1,a2);
     return 1;
   case SYS_cgetc:
@@ -430,6 +828,26 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
     return sys_ipc_recv((void*)a1);
   case SYS_ipc_try_send:
     return sys_ipc_try_send(a1,a2,(void*)a3,a4);
+  case SYS_env_set_runtime:
+    return sys_env_set_runtime(a1,a2);
+  case SYS_env_set_weight:
+    return sys_env_set_weight(a1,a2);
+  case SYS_env_set_tickets:
+    return sys_env_set_tickets(a1,a2);
+  case SYS_env_set_rt:
+    return sys_env_set_rt(a1,a2,a3);
+  case SYS_env_set_affinity:
+    return sys_env_set_affinity(a1,a2);
+  case SYS_time_nsec:
+    return sys_time_nsec((uint64_t*)a1);
+  case SYS_sleep:
+    return sys_sleep(((uint64_t)a2 << 32) | a1);
+  case SYS_yield_to:
+    return sys_yield_to(a1);
+  case SYS_env_set_gang:
+    return sys_env_set_gang(a1,a2);
+  case SYS_lock_bench:
+    return sys_lock_bench(a1,(struct LockBench*)a2);
   default:
     return -E_INVAL;
   }
@@ -1,17 +1,40 @@
-#include <inc/lib.h>
+// Kernel clock: nanoseconds since boot, read from the TSC.
+//
+// The TSC frequency is measured against the PIT by lapic_init() (see
+// kern/lapic.c).  All CPUs' TSCs are assumed to run in step, as they
+// do on QEMU and on processors with an invariant TSC.
 
-uint32_t ticks;
+#include <inc/x86.h>
+
+#include <kern/time.h>
+#include <kern/cpu.h>
+
+static uint64_t tsc_boot;       // TSC when the clock read 0
 
 void
-Time(int argc, char **argv)
-{	
-	ticks = 0;
-	while(true){
-		ticks++;
-	}
+time_init(void)
+{
+  tsc_boot = read_tsc();
+}
+
+// Nanoseconds since time_init(), or 0 if the TSC was not calibrated.
+uint64_t
+time_nsec(void)
+{
+  uint64_t t;
+
+  if (!tsc_hz)
+    return 0;
+  // Split into seconds and the rest so that the multiplication
+  // cannot overflow.
+  t = read_tsc() - tsc_boot;
+  return t / tsc_hz * NSEC_PER_SEC + t % tsc_hz * NSEC_PER_SEC / tsc_hz;
 }
 
-uint32_t
-getTicks(){
-	return ticks;
+// Convert a duration in nanoseconds to TSC cycles.
+uint64_t
+nsec_to_tsc(uint64_t nsec)
+{
+  return nsec / NSEC_PER_SEC * tsc_hz +
+    nsec % NSEC_PER_SEC * tsc_hz / NSEC_PER_SEC;
 }
@@ -1,3 +1,17 @@
+/* See COPYRIGHT for copyright information. */
 
+#ifndef JOS_KERN_TIME_H
+#define JOS_KERN_TIME_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
 
-uint32_t getTicks();
+#include <inc/types.h>
+
+#define NSEC_PER_SEC    1000000000ULL
+
+void time_init(void);
+uint64_t time_nsec(void);
+uint64_t nsec_to_tsc(uint64_t nsec);
+
+#endif	// !JOS_KERN_TIME_H
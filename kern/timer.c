@@ -0,0 +1,202 @@
+// Hierarchical timer wheel.
+//
+// Pending timers live in TW_LEVELS wheels of TW_SIZE slots each.  A
+// slot at level l covers TW_SIZE^l jiffies: level 0 holds timers due in
+// the next TW_SIZE jiffies, one slot per jiffy, level 1 those due in
+// the next TW_SIZE^2 jiffies, TW_SIZE jiffies per slot, and so on.
+// Adding and cancelling a timer are O(1).  As time passes, each slot
+// of level l + 1 is "cascaded" into level l when level l wraps around,
+// so every timer moves at most TW_LEVELS - 1 times before it fires.
+// Timers further out than the wheel's range wait in the top level and
+// are refiled from their real expiry time each time they cascade.
+//
+// Nothing here is driven by a periodic tick.  timer_run() catches up
+// to the current time whenever a CPU takes a timer interrupt, using
+// the per-level occupancy bitmaps to skip over empty slots, and
+// timer_next() tells the scheduler when to arm the next interrupt.
+//
+// Protected by sched_lock.
+
+#include <inc/assert.h>
+
+#include <kern/timer.h>
+#include <kern/time.h>
+
+#define TW_BITS         6
+#define TW_SIZE         (1 << TW_BITS)
+#define TW_MASK         (TW_SIZE - 1)
+#define TW_LEVELS       4
+#define TW_MAX          ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+static struct Timer *wheel[TW_LEVELS][TW_SIZE];
+static uint64_t wheel_bitmap[TW_LEVELS];        // Non-empty slots
+static uint64_t wheel_jiffies;                  // Next jiffy to process
+
+static uint64_t
+jiffies(void)
+{
+  return time_nsec() / TIMER_JIFFY_NS;
+}
+
+static void
+slot_insert(struct Timer *t, int level, int slot)
+{
+  t->tm_level = level;
+  t->tm_slot = slot;
+  t->tm_prev = NULL;
+  t->tm_next = wheel[level][slot];
+  if (t->tm_next)
+    t->tm_next->tm_prev = t;
+  wheel[level][slot] = t;
+  wheel_bitmap[level] |= 1ULL << slot;
+}
+
+static void
+slot_remove(struct Timer *t)
+{
+  if (t->tm_prev)
+    t->tm_prev->tm_next = t->tm_next;
+  else
+    wheel[t->tm_level][t->tm_slot] = t->tm_next;
+  if (t->tm_next)
+    t->tm_next->tm_prev = t->tm_prev;
+  if (!wheel[t->tm_level][t->tm_slot])
+    wheel_bitmap[t->tm_level] &= ~(1ULL << t->tm_slot);
+}
+
+// File t under the level and slot for its expiry time.
+static void
+wheel_insert(struct Timer *t)
+{
+  uint64_t when = t->tm_expires, delta;
+  int level;
+
+  if (when < wheel_jiffies) {
+    // Overdue: fire on the next jiffy processed.
+    slot_insert(t, 0, wheel_jiffies & TW_MASK);
+    return;
+  }
+  delta = when - wheel_jiffies;
+  if (delta > TW_MAX) {
+    // Beyond the wheel's range: park t in the farthest top-level
+    // slot.  It is filed again from tm_expires when that slot
+    // cascades, so it never fires early.
+    when = wheel_jiffies + TW_MAX;
+    delta = TW_MAX;
+  }
+  for (level = 0; delta >= (1ULL << (TW_BITS * (level + 1))); level++)
+    /* do nothing */;
+  slot_insert(t, level, (when >> (TW_BITS * level)) & TW_MASK);
+}
+
+// Arm t to call t->tm_func(t->tm_arg) once the kernel clock reaches
+// nsec (rounded up to a jiffy), replacing any earlier setting.
+void
+timer_add(struct Timer *t, uint64_t nsec)
+{
+  timer_cancel(t);
+  if (wheel_jiffies == 0)
+    wheel_jiffies = jiffies();
+  // Round up without overflowing for nsec near ~0.
+  t->tm_expires = nsec / TIMER_JIFFY_NS + (nsec % TIMER_JIFFY_NS != 0);
+  t->tm_pending = 1;
+  wheel_insert(t);
+}
+
+// Disarm t if it is pending.
+void
+timer_cancel(struct Timer *t)
+{
+  if (!t->tm_pending)
+    return;
+  slot_remove(t);
+  t->tm_pending = 0;
+}
+
+// Move every timer in the given slot down the hierarchy.
+static void
+wheel_cascade(int level, int slot)
+{
+  struct Timer *t, *next;
+
+  t = wheel[level][slot];
+  wheel[level][slot] = NULL;
+  wheel_bitmap[level] &= ~(1ULL << slot);
+  for (; t; t = next) {
+    next = t->tm_next;
+    wheel_insert(t);
+  }
+}
+
+// The first jiffy at or after wheel_jiffies at which the wheel has
+// work to do, firing timers or cascading them, or ~0 if it is empty.
+static uint64_t
+wheel_next_event(void)
+{
+  uint64_t best = ~(uint64_t)0, m, rot, ev;
+  int level, idx, dist, shift;
+
+  for (level = 0; level < TW_LEVELS; level++) {
+    if (!wheel_bitmap[level])
+      continue;
+    // Slots of level l are processed at multiples of TW_SIZE^l.
+    shift = TW_BITS * level;
+    m = (wheel_jiffies + (1ULL << shift) - 1) >> shift;
+    idx = m & TW_MASK;
+    // Distance to the next occupied slot, wrapping around.
+    rot = (wheel_bitmap[level] >> idx) |
+      (idx ? wheel_bitmap[level] << (TW_SIZE - idx) : 0);
+    for (dist = 0; !(rot & (1ULL << dist)); dist++)
+      /* do nothing */;
+    ev = (m + dist) << shift;
+    if (ev < best)
+      best = ev;
+  }
+  return best;
+}
+
+// Fire every timer that has expired.  Called on timer interrupts.
+void
+timer_run(void)
+{
+  uint64_t now = jiffies(), next;
+  struct Timer *t;
+  int level, idx;
+
+  while (wheel_jiffies <= now) {
+    next = wheel_next_event();
+    if (next > now) {
+      wheel_jiffies = now + 1;
+      break;
+    }
+    wheel_jiffies = next;
+
+    // Cascade every level that wraps around at this jiffy.
+    for (level = 1; level < TW_LEVELS; level++) {
+      if (wheel_jiffies & ((1ULL << (TW_BITS * level)) - 1))
+        break;
+      idx = (wheel_jiffies >> (TW_BITS * level)) & TW_MASK;
+      wheel_cascade(level, idx);
+    }
+
+    idx = wheel_jiffies & TW_MASK;
+    while ((t = wheel[0][idx])) {
+      slot_remove(t);
+      t->tm_pending = 0;
+      t->tm_func(t->tm_arg);
+    }
+    wheel_jiffies++;
+  }
+}
+
+// Kernel clock time (ns) at which timer_run() next needs to be
+// called, or ~0 if no timer is pending.
+uint64_t
+timer_next(void)
+{
+  uint64_t ev = wheel_next_event();
+
+  if (ev == ~(uint64_t)0)
+    return ev;
+  return ev * TIMER_JIFFY_NS;
+}
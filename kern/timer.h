@@ -0,0 +1,35 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Timer wheel resolution: timers fire on multiples of TIMER_JIFFY_NS
+// nanoseconds of the kernel clock (see kern/time.c).
+#define TIMER_JIFFY_NS  100000
+
+// A one-shot kernel timer.  Embed or allocate one, set tm_func and
+// tm_arg, and pass it to timer_add().  tm_func runs with sched_lock
+// held, from the timer interrupt of whichever CPU first notices
+// that the timer has expired.
+struct Timer {
+  struct Timer *tm_next;        // Next timer in the same wheel slot
+  struct Timer *tm_prev;        // Previous timer in the same wheel slot
+  uint64_t tm_expires;          // Expiry time, in jiffies
+  int tm_level;                 // Wheel level holding the timer
+  int tm_slot;                  // Slot within tm_level
+  bool tm_pending;              // Added and not yet fired or cancelled
+  void (*tm_func)(void *arg);
+  void *tm_arg;
+};
+
+void timer_add(struct Timer *t, uint64_t nsec);
+void timer_cancel(struct Timer *t);
+void timer_run(void);
+uint64_t timer_next(void);
+
+#endif	// !JOS_KERN_TIMER_H
@@ -0,0 +1,136 @@
+// Host-side test of the timer wheel in kern/timer.c.
+//
+// Built with the native compiler and run by 'make timertest'.  The
+// kernel clock is simulated: the test adds, cancels and re-adds
+// timers at random, including ones far beyond the wheel's range, and
+// advances the clock by random steps, checking after each step that
+// exactly the timers whose expiry has passed have fired, each once.
+
+#include <kern/timer.c>
+
+int printf(const char *fmt, ...);
+void exit(int status) __attribute__((noreturn));
+
+#define NTIMERS         512
+#define NSTEPS          200000
+
+static uint64_t now_nsec;
+static uint64_t rand_state = 88172645463325252ULL;
+
+static struct Timer timers[NTIMERS];
+static uint64_t deadline[NTIMERS];      // Expiry time (ns), 0 if idle
+static int nfired[NTIMERS];
+
+uint64_t
+time_nsec(void)
+{
+  return now_nsec;
+}
+
+void
+_panic(const char *file, int line, const char *fmt, ...)
+{
+  printf("%s:%d: panic: %s\n", file, line, fmt);
+  exit(1);
+}
+
+static uint64_t
+rnd(void)
+{
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 7;
+  rand_state ^= rand_state << 17;
+  return rand_state;
+}
+
+static void
+fire(void *arg)
+{
+  int i = (struct Timer *)arg - timers;
+
+  if (!deadline[i] || now_nsec < deadline[i] || nfired[i]) {
+    printf("timer %d fired at %llu, deadline %llu, fired %d times\n",
+           i, now_nsec, deadline[i], nfired[i]);
+    exit(1);
+  }
+  nfired[i]++;
+}
+
+// A random expiry delay: mostly short, sometimes past each level of
+// the wheel, occasionally beyond its whole range.
+static uint64_t
+rnd_delay(void)
+{
+  static const uint64_t span[] = {
+    TW_SIZE, TW_SIZE * TW_SIZE, TW_SIZE * TW_SIZE * TW_SIZE,
+    TW_MAX, 4 * TW_MAX
+  };
+
+  return rnd() % (span[rnd() % 5] * TIMER_JIFFY_NS);
+}
+
+// Advance the clock by a random step; big jumps let far-future
+// timers expire within the run.
+static uint64_t
+rnd_step(void)
+{
+  switch (rnd() % 8) {
+  case 0:
+    return rnd() % (TW_MAX * TIMER_JIFFY_NS);
+  case 1:
+  case 2:
+    return rnd() % (TW_SIZE * TW_SIZE * TIMER_JIFFY_NS);
+  default:
+    return rnd() % (4 * TIMER_JIFFY_NS);
+  }
+}
+
+int
+main(void)
+{
+  int step, i, op, nadd = 0, nfire = 0;
+  uint64_t jiffy;
+
+  now_nsec = 12345 * TIMER_JIFFY_NS + 678;
+  for (i = 0; i < NTIMERS; i++) {
+    timers[i].tm_func = fire;
+    timers[i].tm_arg = &timers[i];
+  }
+
+  for (step = 0; step < NSTEPS; step++) {
+    i = rnd() % NTIMERS;
+    op = rnd() % 64;
+    if (op < 16) {
+      timer_cancel(&timers[i]);
+      deadline[i] = 0;
+    } else {
+      // Now and then, the end of time: such a timer must never fire.
+      deadline[i] = op == 16 ? ~(uint64_t)0 : now_nsec + rnd_delay();
+      nfired[i] = 0;
+      timer_add(&timers[i], deadline[i]);
+      nadd++;
+    }
+
+    now_nsec += rnd_step();
+    timer_run();
+
+    // Every timer fires on the first jiffy at or after its deadline.
+    jiffy = now_nsec / TIMER_JIFFY_NS * TIMER_JIFFY_NS;
+    for (i = 0; i < NTIMERS; i++) {
+      if (!deadline[i])
+        continue;
+      if (nfired[i] != (deadline[i] <= jiffy) ||
+          timers[i].tm_pending == nfired[i]) {
+        printf("step %d: timer %d deadline %llu now %llu fired %d\n",
+               step, i, deadline[i], now_nsec, nfired[i]);
+        return 1;
+      }
+      if (nfired[i]) {
+        deadline[i] = 0;
+        nfire++;
+      }
+    }
+  }
+  printf("timertest: %d adds, %d fired: OK\n", nadd, nfire);
+  return 0;
+}
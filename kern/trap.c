@@ -109,6 +109,7 @@ trap_init(void)
   SETGATE(idt[46],0,0x8,&IRQIDE,3);
   SETGATE(idt[47],0,0x8,&IRQ15,3);
   SETGATE(idt[48],0,0x8,&SYSCALL,3);
+  SETGATE(idt[T_RESCHED],0,0x8,&RESCHED,0);
   SETGATE(idt[51],0,0x8,&IRQERROR,3);
   SETGATE(idt[500],0,0x8,&DEFAULT,3);
 
@@ -224,6 +225,7 @@ trap_dispatch(struct Trapframe *tf)
   // LAB 3: Your code here.
   if(tf->tf_trapno == T_PGFLT){
     page_fault_handler(tf);
+    return;
   }else if(tf->tf_trapno == T_SYSCALL){
     struct PushRegs* regs = &tf->tf_regs;
     regs->reg_eax=syscall(regs->reg_eax,regs->reg_edx,regs->reg_ecx,regs->reg_ebx,regs->reg_edi,regs->reg_esi);
@@ -250,12 +252,18 @@ trap_dispatch(struct Trapframe *tf)
     monitor(tf);
   }else if(tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER){
     lapic_eoi();
-    sched_yield();
+    sched_tick();
+    return;
+  }else if(tf->tf_trapno == T_RESCHED){
+    lapic_eoi();
+    sched_ipi();
+    return;
   }else if(tf->tf_cs == GD_KT){
     print_trapframe(tf);
     panic("unhandled trap in kernel");
   }else{
     print_trapframe(tf);
+    env_lock(curenv);
     env_destroy(curenv);
     return;
   }
@@ -273,27 +281,42 @@ trap(struct Trapframe *tf)
   if (panicstr)
     asm volatile ("hlt");
 
-  // Re-acqurie the big kernel lock if we were halted in
-  // sched_yield()
-  if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-    lock_kernel();
+  // A few system calls need none of the work below, not even the
+  // trapframe copy.  Only user mode can make a system call, so this
+  // CPU is not halted and the frame is a user frame.  syscall_fast()
+  // charged the user time up to the trap; the call itself is kernel
+  // time, as sched_switch() would count it.
+  if (tf->tf_trapno == T_SYSCALL && syscall_fast(tf)) {
+    curenv->env_tsc_in = read_tsc();
+    curenv->env_systime += curenv->env_tsc_in - curenv->env_tsc_out;
+    env_pop_tf(tf);
+  }
+
+  // We are no longer halted in sched_halt(), if we were.  The code
+  // below takes only the locks it needs.
+  xchg(&thiscpu->cpu_status, CPU_STARTED);
   // Check that interrupts are disabled.  If this assertion
   // fails, DO NOT be tempted to fix it by inserting a "cli" in
   // the interrupt path.
   assert(!(read_eflags() & FL_IF));
 
+  // Free the env this CPU last switched away from if it was dying.
+  env_reap();
+
   if ((tf->tf_cs & 3) == 3) {
     // Trapped from user mode.
-    // Acquire the big kernel lock before doing any
-    // serious kernel work.
-    // LAB 4: Your code here.
-    lock_kernel();
     assert(curenv);
 
+    // Charge the time since env_run() to the env.
+    sched_charge(curenv);
+
     // Garbage collect if current enviroment is a zombie
     if (curenv->env_status == ENV_DYING) {
+      env_lock(curenv);
       env_free(curenv);
+      env_unlock(curenv);
       curenv = NULL;
+      lock_sched();
       sched_yield();
     }
 
@@ -314,12 +337,15 @@ trap(struct Trapframe *tf)
 
   // If we made it to this point, then no other environment was
   // scheduled, so we should return to the current environment
-  // if doing so makes sense.
-  if (curenv && curenv->env_status == ENV_RUNNING){
+  // if doing so makes sense.  Most system calls never touch the
+  // scheduler, and return without taking sched_lock.
+  if (curenv && curenv->env_status == ENV_RUNNING &&
+      !thiscpu->cpu_sched_dirty)
+    env_resume();
+  lock_sched();
+  if (curenv && curenv->env_status == ENV_RUNNING)
     env_run(curenv);
-  }else{
-    sched_yield();
-  }
+  sched_yield();
 }
 
 
@@ -359,17 +385,21 @@ page_fault_handler(struct Trapframe *tf)
 
     UXSTK -= sizeof(struct UTrapframe);
     struct UTrapframe *u = (struct UTrapframe*) UXSTK;
-    user_mem_assert(curenv, u, sizeof (struct UTrapframe), PTE_W);
+    // Hold our env lock so that our parent cannot unmap the
+    // exception stack while we write to it.
+    user_mem_lock(curenv, u, sizeof (struct UTrapframe), PTE_W);
     u->utf_fault_va = fault_va;
     u->utf_err = tf->tf_err;
     u->utf_regs = tf->tf_regs;
     u->utf_eip = tf->tf_eip;
     u->utf_eflags = tf->tf_eflags;
     u->utf_esp = tf->tf_esp;
+    env_unlock(curenv);
 
+    // Return to the upcall (see trap()).
     tf->tf_esp = UXSTK;
     tf->tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
-    env_run(curenv);
+    return;
   }
 
   // If there's no page fault upcall, the environment didn't allocate a
@@ -379,6 +409,7 @@ page_fault_handler(struct Trapframe *tf)
 	curenv->env_id, fault_va, tf->tf_eip);
   print_trapframe(tf);
 
+  env_lock(curenv);
   env_destroy(curenv);
 }
 
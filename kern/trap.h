@@ -55,6 +55,7 @@ extern void IRQIDE();
 extern void IRQ15();
 extern void IRQERROR();
 extern void SYSCALL();
+extern void RESCHED();
 extern void DEFAULT();
 
 #endif /* JOS_KERN_TRAP_H */
@@ -91,6 +91,39 @@ duppage(envid_t envid, unsigned pn)
   return 0;
 }
 
+//
+// Give the target envid the 4MB page at page directory index pdx.
+// With PTE_SHARE the page itself is shared; otherwise the child gets a
+// copy, made now rather than on write since the page fault handler
+// only copies 4K pages.  The copy is made through the first unused
+// 4MB of our address space.
+//
+static void
+duplarge(envid_t envid, unsigned pdx)
+{
+  void *va = PGADDR(pdx, 0, 0), *tmp;
+  int perm = uvpd[pdx] & PTE_SYSCALL, r;
+  unsigned t;
+
+  if (perm & PTE_SHARE) {
+    if ((r = sys_page_map(0, va, envid, va, perm)) < 0)
+      panic("duplarge: share: %e", r);
+    return;
+  }
+  for (t = 1; t < PDX(UTOP) && (uvpd[t] & PTE_P); t++)
+    /* do nothing */;
+  if (t == PDX(UTOP))
+    panic("duplarge: no free 4MB to copy through");
+  tmp = PGADDR(t, 0, 0);
+  if ((r = sys_page_alloc(0, tmp, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+    panic("duplarge: alloc: %e", r);
+  memmove(tmp, va, PTSIZE);
+  if ((r = sys_page_map(0, tmp, envid, va, perm)) < 0)
+    panic("duplarge: map: %e", r);
+  if ((r = sys_page_unmap(0, tmp)) < 0)
+    panic("duplarge: unmap: %e", r);
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -128,6 +161,11 @@ fork(void)
     if (!(uvpd[ipd] & PTE_P))
       continue;
 
+    if (uvpd[ipd] & PTE_PS) {
+      duplarge(envid, ipd);
+      continue;
+    }
+
     int ipt;
     for (ipt = 0; ipt != NPTENTRIES; ++ipt) {
       unsigned pn = (ipd << 10) | ipt;
@@ -72,7 +72,8 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
   int RV = sys_ipc_try_send(to_env,val,pg,perm);
   while(RV == -E_IPC_NOT_RECV){
     //cprintf("IPC_SEND: NOT YET RECIEVING\n");
-    sys_yield();
+    // The receiver is busy; let it run so that it gets to ipc_recv.
+    sys_yield_to(to_env);
     RV = sys_ipc_try_send(to_env,val,pg,perm);
   }
   //cprintf("%d %d %d %d\n",RV,-E_BAD_ENV,-E_INVAL,-E_NO_MEM);
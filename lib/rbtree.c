@@ -0,0 +1,240 @@
+// Red-black trees, following CLRS chapter 13 with NULL leaves.
+
+#include <inc/rbtree.h>
+
+static void
+rb_rotate_left(struct rb_tree *t, struct rb_node *x)
+{
+  struct rb_node *y = x->rb_right;
+
+  x->rb_right = y->rb_left;
+  if (y->rb_left)
+    y->rb_left->rb_parent = x;
+  y->rb_parent = x->rb_parent;
+  if (!x->rb_parent)
+    t->rb_root = y;
+  else if (x == x->rb_parent->rb_left)
+    x->rb_parent->rb_left = y;
+  else
+    x->rb_parent->rb_right = y;
+  y->rb_left = x;
+  x->rb_parent = y;
+}
+
+static void
+rb_rotate_right(struct rb_tree *t, struct rb_node *x)
+{
+  struct rb_node *y = x->rb_left;
+
+  x->rb_left = y->rb_right;
+  if (y->rb_right)
+    y->rb_right->rb_parent = x;
+  y->rb_parent = x->rb_parent;
+  if (!x->rb_parent)
+    t->rb_root = y;
+  else if (x == x->rb_parent->rb_right)
+    x->rb_parent->rb_right = y;
+  else
+    x->rb_parent->rb_left = y;
+  y->rb_right = x;
+  x->rb_parent = y;
+}
+
+// Insert n, whose rb_key the caller has already set.
+void
+rb_insert(struct rb_tree *t, struct rb_node *n)
+{
+  struct rb_node **link = &t->rb_root;
+  struct rb_node *p = NULL, *g, *u;
+  bool leftmost = 1;
+
+  while (*link) {
+    p = *link;
+    if (n->rb_key < p->rb_key)
+      link = &p->rb_left;
+    else {
+      link = &p->rb_right;
+      leftmost = 0;
+    }
+  }
+  n->rb_parent = p;
+  n->rb_left = n->rb_right = NULL;
+  n->rb_red = 1;
+  *link = n;
+  if (leftmost)
+    t->rb_leftmost = n;
+
+  // Restore the red-black properties.
+  while ((p = n->rb_parent) && p->rb_red) {
+    g = p->rb_parent;
+    if (p == g->rb_left) {
+      u = g->rb_right;
+      if (u && u->rb_red) {
+        p->rb_red = u->rb_red = 0;
+        g->rb_red = 1;
+        n = g;
+        continue;
+      }
+      if (n == p->rb_right) {
+        rb_rotate_left(t, p);
+        n = p;
+        p = n->rb_parent;
+      }
+      p->rb_red = 0;
+      g->rb_red = 1;
+      rb_rotate_right(t, g);
+    } else {
+      u = g->rb_left;
+      if (u && u->rb_red) {
+        p->rb_red = u->rb_red = 0;
+        g->rb_red = 1;
+        n = g;
+        continue;
+      }
+      if (n == p->rb_left) {
+        rb_rotate_right(t, p);
+        n = p;
+        p = n->rb_parent;
+      }
+      p->rb_red = 0;
+      g->rb_red = 1;
+      rb_rotate_left(t, g);
+    }
+  }
+  t->rb_root->rb_red = 0;
+}
+
+// Replace the subtree rooted at u with the one rooted at v.
+static void
+rb_transplant(struct rb_tree *t, struct rb_node *u, struct rb_node *v)
+{
+  if (!u->rb_parent)
+    t->rb_root = v;
+  else if (u == u->rb_parent->rb_left)
+    u->rb_parent->rb_left = v;
+  else
+    u->rb_parent->rb_right = v;
+  if (v)
+    v->rb_parent = u->rb_parent;
+}
+
+static inline bool
+rb_is_red(struct rb_node *n)
+{
+  return n && n->rb_red;
+}
+
+// Remove n, which must be in t.
+void
+rb_remove(struct rb_tree *t, struct rb_node *n)
+{
+  struct rb_node *y = n, *x, *xp, *w;
+  int y_red = n->rb_red;
+
+  if (t->rb_leftmost == n)
+    t->rb_leftmost = rb_next(n);
+
+  if (!n->rb_left) {
+    x = n->rb_right;
+    xp = n->rb_parent;
+    rb_transplant(t, n, n->rb_right);
+  } else if (!n->rb_right) {
+    x = n->rb_left;
+    xp = n->rb_parent;
+    rb_transplant(t, n, n->rb_left);
+  } else {
+    for (y = n->rb_right; y->rb_left; y = y->rb_left)
+      /* do nothing */;
+    y_red = y->rb_red;
+    x = y->rb_right;
+    if (y->rb_parent == n)
+      xp = y;
+    else {
+      xp = y->rb_parent;
+      rb_transplant(t, y, y->rb_right);
+      y->rb_right = n->rb_right;
+      y->rb_right->rb_parent = y;
+    }
+    rb_transplant(t, n, y);
+    y->rb_left = n->rb_left;
+    y->rb_left->rb_parent = y;
+    y->rb_red = n->rb_red;
+  }
+  if (y_red)
+    return;
+
+  // A black node was removed; x carries an extra black.
+  while (x != t->rb_root && !rb_is_red(x)) {
+    if (x == xp->rb_left) {
+      w = xp->rb_right;
+      if (w->rb_red) {
+        w->rb_red = 0;
+        xp->rb_red = 1;
+        rb_rotate_left(t, xp);
+        w = xp->rb_right;
+      }
+      if (!rb_is_red(w->rb_left) && !rb_is_red(w->rb_right)) {
+        w->rb_red = 1;
+        x = xp;
+        xp = x->rb_parent;
+      } else {
+        if (!rb_is_red(w->rb_right)) {
+          w->rb_left->rb_red = 0;
+          w->rb_red = 1;
+          rb_rotate_right(t, w);
+          w = xp->rb_right;
+        }
+        w->rb_red = xp->rb_red;
+        xp->rb_red = 0;
+        if (w->rb_right)
+          w->rb_right->rb_red = 0;
+        rb_rotate_left(t, xp);
+        x = t->rb_root;
+      }
+    } else {
+      w = xp->rb_left;
+      if (w->rb_red) {
+        w->rb_red = 0;
+        xp->rb_red = 1;
+        rb_rotate_right(t, xp);
+        w = xp->rb_left;
+      }
+      if (!rb_is_red(w->rb_right) && !rb_is_red(w->rb_left)) {
+        w->rb_red = 1;
+        x = xp;
+        xp = x->rb_parent;
+      } else {
+        if (!rb_is_red(w->rb_left)) {
+          w->rb_right->rb_red = 0;
+          w->rb_red = 1;
+          rb_rotate_left(t, w);
+          w = xp->rb_left;
+        }
+        w->rb_red = xp->rb_red;
+        xp->rb_red = 0;
+        if (w->rb_left)
+          w->rb_left->rb_red = 0;
+        rb_rotate_right(t, xp);
+        x = t->rb_root;
+      }
+    }
+  }
+  if (x)
+    x->rb_red = 0;
+}
+
+// Return the in-order successor of n, or NULL if n is the last node.
+struct rb_node *
+rb_next(struct rb_node *n)
+{
+  struct rb_node *p;
+
+  if (n->rb_right) {
+    for (n = n->rb_right; n->rb_left; n = n->rb_left)
+      /* do nothing */;
+    return n;
+  }
+  while ((p = n->rb_parent) && n == p->rb_right)
+    n = p;
+  return p;
+}
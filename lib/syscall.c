@@ -111,3 +111,65 @@ sys_ipc_recv(void *dstva)
   return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_env_set_runtime(envid_t envid, uint32_t est)
+{
+  return syscall(SYS_env_set_runtime, 1, envid, est, 0, 0, 0);
+}
+
+int
+sys_env_set_weight(envid_t envid, uint32_t weight)
+{
+  return syscall(SYS_env_set_weight, 1, envid, weight, 0, 0, 0);
+}
+
+int
+sys_env_set_tickets(envid_t envid, uint32_t tickets)
+{
+  return syscall(SYS_env_set_tickets, 1, envid, tickets, 0, 0, 0);
+}
+
+int
+sys_env_set_rt(envid_t envid, uint32_t period, uint32_t budget)
+{
+  return syscall(SYS_env_set_rt, 1, envid, period, budget, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+  return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+uint64_t
+sys_time_nsec(void)
+{
+  uint64_t nsec;
+
+  syscall(SYS_time_nsec, 0, (uint32_t)&nsec, 0, 0, 0, 0);
+  return nsec;
+}
+
+int
+sys_sleep(uint64_t nsec)
+{
+  return syscall(SYS_sleep, 0, (uint32_t)nsec, nsec >> 32, 0, 0, 0);
+}
+
+int
+sys_yield_to(envid_t envid)
+{
+  return syscall(SYS_yield_to, 0, envid, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_gang(envid_t envid, envid_t gang)
+{
+  return syscall(SYS_env_set_gang, 1, envid, gang, 0, 0, 0);
+}
+
+int
+sys_lock_bench(int kind, struct LockBench *lb)
+{
+  return syscall(SYS_lock_bench, 1, kind, (uint32_t)lb, 0, 0, 0);
+}
@@ -0,0 +1,15 @@
+// buggy program - passes sys_lock_bench a results buffer in its own
+// read-only text.  kernel should destroy the environment in
+// response, not fault on storing the results
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+  int r;
+
+  sys_env_set_affinity(0, 1 << 0);
+  r = sys_lock_bench(SPIN_TAS, (struct LockBench *) umain);
+  cprintf("sys_lock_bench into %08x returned %e\n", umain, r);
+}
@@ -0,0 +1,31 @@
+// buggy program - asks the kernel to store the time into read-only
+// memory: the child into its own text, the parent into a
+// copy-on-write data page.  kernel should destroy each environment
+// in response, not fault on the store itself
+
+#include <inc/lib.h>
+
+uint64_t when = 1;      // In .data, so copy-on-write after fork
+
+static void
+time_to(void *va)
+{
+  int32_t r;
+
+  // sys_time_nsec() always passes its own stack; call the kernel
+  // directly with va instead.
+  asm volatile ("int %1\n"
+                : "=a" (r)
+                : "i" (T_SYSCALL), "a" (SYS_time_nsec), "d" (va)
+                : "cc", "memory");
+  cprintf("time_nsec into %08x returned %e\n", va, r);
+}
+
+void
+umain(int argc, char **argv)
+{
+  if (fork() == 0)
+    time_to(umain);
+  else
+    time_to(&when);
+}
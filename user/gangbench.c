@@ -0,0 +1,117 @@
+// Measure gang scheduling.  Run one worker per CPU through ROUNDS
+// spinning barriers, alongside as many CPU-bound spinners, first with
+// the workers scheduled independently and then as one gang, and
+// report how long the workers took each time.  A worker that reaches
+// a barrier spins until every other worker has too, so it only makes
+// progress while all of its peers hold a CPU at once.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define ROUNDS          100
+#define MAXCPU          32      // Bits in an affinity mask
+#define MSEC            1000000ULL
+
+struct Shared {
+  volatile uint32_t arrived[ROUNDS];    // Workers past each barrier
+  volatile int stop;                    // Spinners should exit
+};
+
+// Shared with the children once they are forked.
+#define SHARED          ((struct Shared *) UTEMP)
+
+static int nworkers;
+
+static void
+wait_shared(void)
+{
+  while (!(uvpd[PDX(SHARED)] & PTE_P) || !(uvpt[PGNUM(SHARED)] & PTE_P))
+    sys_yield();
+}
+
+static void
+worker(void)
+{
+  int r;
+
+  wait_shared();
+  for (r = 0; r < ROUNDS; r++) {
+    xadd(&SHARED->arrived[r], 1);
+    while (SHARED->arrived[r] < nworkers)
+      asm volatile ("pause");
+  }
+}
+
+static void
+spinner(void)
+{
+  wait_shared();
+  while (!SHARED->stop)
+    asm volatile ("pause");
+}
+
+static void
+wait_exit(envid_t *ids, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    while (envs[ENVX(ids[i])].env_id == ids[i] &&
+           envs[ENVX(ids[i])].env_status != ENV_FREE)
+      sys_yield();
+}
+
+static void
+run(bool gang)
+{
+  envid_t work[MAXCPU], spin[MAXCPU], id;
+  uint64_t start;
+  int i, r;
+
+  sys_page_unmap(0, SHARED);
+  for (i = 0; i < 2 * nworkers; i++) {
+    id = fork();
+    if (id < 0)
+      panic("fork: %e", id);
+    if (id == 0) {
+      if (i < nworkers)
+        worker();
+      else
+        spinner();
+      exit();
+    }
+    if (i < nworkers) {
+      work[i] = id;
+      if (gang && (r = sys_env_set_gang(id, thisenv->env_id)) < 0)
+        panic("sys_env_set_gang: %e", r);
+    } else
+      spin[i - nworkers] = id;
+  }
+
+  if ((r = sys_page_alloc(0, SHARED, PTE_P|PTE_U|PTE_W)) < 0)
+    panic("sys_page_alloc: %e", r);
+  start = sys_time_nsec();
+  for (i = 0; i < nworkers; i++)
+    if ((r = sys_page_map(0, SHARED, work[i], SHARED, PTE_P|PTE_U|PTE_W)) < 0 ||
+        (r = sys_page_map(0, SHARED, spin[i], SHARED, PTE_P|PTE_U|PTE_W)) < 0)
+      panic("sys_page_map: %e", r);
+  wait_exit(work, nworkers);
+  cprintf("%-7s %7d %6d %10llu\n", gang ? "gang" : "no gang", nworkers,
+          ROUNDS, (sys_time_nsec() - start) / MSEC);
+  SHARED->stop = 1;
+  wait_exit(spin, nworkers);
+}
+
+void
+umain(int argc, char **argv)
+{
+  // Count the CPUs by trying to run on each in turn.
+  for (nworkers = 0; nworkers < MAXCPU; nworkers++)
+    if (sys_env_set_affinity(0, 1 << nworkers) < 0)
+      break;
+  sys_env_set_affinity(0, ~0);
+
+  cprintf("mode   workers rounds    time/ms\n");
+  run(0);
+  run(1);
+}
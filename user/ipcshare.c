@@ -0,0 +1,79 @@
+// Check that stride tickets lent over IPC keep clients' CPU shares
+// proportional to their own tickets.  NCLIENTS clients with different
+// tickets each loop doing a fixed amount of work and then a request
+// to one server, which does a little work and replies.  The server
+// counts each client's requests for RUN_MSEC and checks that every
+// client got within 20% of its share of the rounds.  Run on one CPU
+// under SCHED_STRIDE.
+
+#include <inc/lib.h>
+
+#define NCLIENTS        3
+#define RUN_MSEC        500
+#define MSEC            1000000ULL
+#define CLIENT_WORK     200000  // Loop iterations per request
+#define SERVER_WORK     (CLIENT_WORK / 10)
+
+static const uint32_t tickets[NCLIENTS] = { 100, 200, 300 };
+
+static void
+work(int n)
+{
+  volatile int i;
+
+  for (i = 0; i < n; i++)
+    /* do nothing */;
+}
+
+static void
+client(envid_t server)
+{
+  while (1) {
+    work(CLIENT_WORK);
+    ipc_send(server, 0, 0, 0);
+    ipc_recv(0, 0, 0);
+  }
+}
+
+void
+umain(int argc, char **argv)
+{
+  envid_t server = sys_getenvid(), who, id[NCLIENTS];
+  uint32_t rounds[NCLIENTS] = { 0 }, total = 0, tsum = 0, pct;
+  uint64_t end;
+  bool ok = 1;
+  int i, r;
+
+  for (i = 0; i < NCLIENTS; i++) {
+    if ((id[i] = fork()) < 0)
+      panic("fork: %e", id[i]);
+    if (id[i] == 0)
+      client(server);
+    if ((r = sys_env_set_tickets(id[i], tickets[i])) < 0)
+      panic("sys_env_set_tickets: %e", r);
+    tsum += tickets[i];
+  }
+
+  end = sys_time_nsec() + RUN_MSEC * MSEC;
+  while (sys_time_nsec() < end) {
+    ipc_recv(&who, 0, 0);
+    for (i = 0; i < NCLIENTS; i++)
+      if (who == id[i])
+        rounds[i]++;
+    work(SERVER_WORK);
+    ipc_send(who, 0, 0, 0);
+  }
+  for (i = 0; i < NCLIENTS; i++) {
+    sys_env_destroy(id[i]);
+    total += rounds[i];
+  }
+
+  cprintf("client tickets  rounds  %% of fair share\n");
+  for (i = 0; i < NCLIENTS; i++) {
+    pct = total ? (uint64_t) rounds[i] * tsum * 100 / (total * tickets[i]) : 0;
+    cprintf("%6d %7d %7d %17d\n", i, tickets[i], rounds[i], pct);
+    if (pct < 80 || pct > 120)
+      ok = 0;
+  }
+  cprintf("ipcshare: %s\n", ok ? "OK" : "FAIL");
+}
@@ -0,0 +1,90 @@
+// Test 4MB (PTE_PS) user pages: allocate one, check that it is zeroed,
+// copied for a forked child (or shared with it, given PTE_SHARE), and
+// only mapped and unmapped as a whole, and compare
+// the time to touch every 4K page of it with the time to do the same
+// over 4MB of ordinary pages.
+
+#include <inc/lib.h>
+
+#define LARGE   ((char *) 0x10000000)
+#define SMALL   ((char *) 0x10400000)
+#define SHARED  ((char *) 0x10800000)
+#define PASSES  64
+
+static uint64_t
+touch(volatile char *va)
+{
+  uint64_t start;
+  int pass, i;
+
+  start = sys_time_nsec();
+  for (pass = 0; pass < PASSES; pass++)
+    for (i = 0; i < PTSIZE; i += PGSIZE)
+      va[i]++;
+  return sys_time_nsec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+  uint64_t large, small;
+  envid_t child;
+  int i, r;
+
+  r = sys_page_alloc(0, LARGE + PGSIZE, PTE_P|PTE_U|PTE_W|PTE_PS);
+  if (r != -E_INVAL)
+    panic("misaligned 4MB page: got %e, not -E_INVAL", r);
+  if ((r = sys_page_alloc(0, LARGE, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+    panic("sys_page_alloc: %e", r);
+  if (!(uvpd[PDX(LARGE)] & PTE_PS))
+    panic("4MB page not mapped with PTE_PS");
+  for (i = 0; i < PTSIZE; i += sizeof(int))
+    if (*(int *) (LARGE + i) != 0)
+      panic("4MB page not zeroed at offset %x", i);
+
+  // The child gets its own copy, unless the page is PTE_SHARE.
+  if ((r = sys_page_alloc(0, SHARED, PTE_P|PTE_U|PTE_W|PTE_PS|PTE_SHARE)) < 0)
+    panic("sys_page_alloc: %e", r);
+  LARGE[PTSIZE - 1] = 1;
+  SHARED[PTSIZE - 1] = 1;
+  if ((child = fork()) < 0)
+    panic("fork: %e", child);
+  if (child == 0) {
+    if (LARGE[PTSIZE - 1] != 1)
+      panic("4MB page not copied for the child");
+    LARGE[PTSIZE - 1] = 2;
+    SHARED[PTSIZE - 1] = 2;
+    exit();
+  }
+  while (envs[ENVX(child)].env_id == child &&
+         envs[ENVX(child)].env_status != ENV_FREE)
+    sys_yield();
+  if (LARGE[PTSIZE - 1] != 1)
+    panic("child's write to its copy of a 4MB page seen by the parent");
+  if (SHARED[PTSIZE - 1] != 2)
+    panic("PTE_SHARE 4MB page not shared with the child");
+  if ((r = sys_page_unmap(0, SHARED)) < 0)
+    panic("sys_page_unmap: %e", r);
+
+  for (i = 0; i < PTSIZE; i += PGSIZE)
+    if ((r = sys_page_alloc(0, SMALL + i, PTE_P|PTE_U|PTE_W)) < 0)
+      panic("sys_page_alloc: %e", r);
+  large = touch(LARGE);
+  small = touch(SMALL);
+  cprintf("touching 1024 pages %d times: %llu us with a 4MB page, "
+          "%llu us with 4K pages\n", PASSES, large / 1000, small / 1000);
+
+  // 4K pages cannot be mapped or unmapped inside it; unmapping it at
+  // its first address unmaps all of it.
+  r = sys_page_alloc(0, LARGE + 5 * PGSIZE, PTE_P|PTE_U|PTE_W);
+  if (r != -E_INVAL)
+    panic("4K page inside a 4MB page: got %e, not -E_INVAL", r);
+  r = sys_page_unmap(0, LARGE + 5 * PGSIZE);
+  if (r != -E_INVAL)
+    panic("4K unmap inside a 4MB page: got %e, not -E_INVAL", r);
+  if ((r = sys_page_unmap(0, LARGE)) < 0)
+    panic("sys_page_unmap: %e", r);
+  if (uvpd[PDX(LARGE)] & PTE_P)
+    panic("4MB page still mapped");
+  cprintf("largepage: OK\n");
+}
@@ -0,0 +1,106 @@
+// Measure the kernel's spin lock implementations under contention.
+// For each lock kind and for 1, 2, 4, ... CPUs, run one env pinned to
+// each CPU, all hammering the same kernel lock through sys_lock_bench
+// for RUN_MSEC, and report the average and worst wait per acquisition
+// and how evenly the acquisitions were spread across the CPUs.
+
+#include <inc/lib.h>
+
+#define RUN_MSEC        50
+#define MSEC            1000000ULL
+#define MAXCPU          32      // Bits in an affinity mask
+
+// Shared with the children once they are forked; holds each CPU's
+// times going in and its results coming out.
+#define RESULTS         ((struct LockBench *) UTEMP)
+
+static const char *kinds[NSPINKINDS] = {
+  [SPIN_TAS] = "tas",
+  [SPIN_TICKET] = "ticket",
+  [SPIN_MCS] = "mcs",
+};
+
+static int kind;
+
+static void
+bench_child(int cpu)
+{
+  struct LockBench lb;
+  int r;
+
+  sys_env_set_affinity(0, 1 << cpu);
+  // Wait for the parent to share the results page.
+  while (!(uvpd[PDX(RESULTS)] & PTE_P) || !(uvpt[PGNUM(RESULTS)] & PTE_P))
+    sys_yield();
+  lb = RESULTS[cpu];
+  if ((r = sys_lock_bench(kind, &lb)) < 0)
+    panic("sys_lock_bench: %e", r);
+  RESULTS[cpu] = lb;
+}
+
+static void
+run(int ncpu)
+{
+  envid_t child[MAXCPU];
+  uint64_t start, acquires, wait, maxwait, sumsq;
+  uint32_t fair;
+  int i, r;
+
+  sys_page_unmap(0, RESULTS);
+  for (i = 0; i < ncpu; i++) {
+    if ((child[i] = fork()) < 0)
+      panic("fork: %e", child[i]);
+    if (child[i] == 0) {
+      bench_child(i);
+      exit();
+    }
+  }
+
+  if ((r = sys_page_alloc(0, RESULTS, PTE_P|PTE_U|PTE_W)) < 0)
+    panic("sys_page_alloc: %e", r);
+  start = sys_time_nsec() + 20 * MSEC;
+  for (i = 0; i < ncpu; i++) {
+    RESULTS[i].lb_start = start;
+    RESULTS[i].lb_end = start + RUN_MSEC * MSEC;
+  }
+  for (i = 0; i < ncpu; i++)
+    if ((r = sys_page_map(0, RESULTS, child[i], RESULTS,
+                          PTE_P|PTE_U|PTE_W)) < 0)
+      panic("sys_page_map: %e", r);
+  for (i = 0; i < ncpu; i++)
+    while (envs[ENVX(child[i])].env_id == child[i] &&
+           envs[ENVX(child[i])].env_status != ENV_FREE)
+      sys_yield();
+
+  acquires = wait = maxwait = sumsq = 0;
+  for (i = 0; i < ncpu; i++) {
+    acquires += RESULTS[i].lb_acquires;
+    wait += RESULTS[i].lb_wait;
+    if (RESULTS[i].lb_maxwait > maxwait)
+      maxwait = RESULTS[i].lb_maxwait;
+    sumsq += (uint64_t) RESULTS[i].lb_acquires * RESULTS[i].lb_acquires;
+  }
+  // Jain's fairness index, in thousandths: 1000 if every CPU got the
+  // lock equally often, 1000/ncpu if one CPU got it every time.
+  fair = sumsq ? acquires * acquires * 1000 / (ncpu * sumsq) : 0;
+  cprintf("%-6s %4d %10llu %10llu %10llu   %d.%03d\n", kinds[kind], ncpu,
+          acquires, acquires ? wait / acquires : 0, maxwait,
+          fair / 1000, fair % 1000);
+}
+
+void
+umain(int argc, char **argv)
+{
+  int ncpu, n;
+
+  // Count the CPUs by trying to run on each in turn.
+  for (ncpu = 0; ncpu < MAXCPU; ncpu++)
+    if (sys_env_set_affinity(0, 1 << ncpu) < 0)
+      break;
+  sys_env_set_affinity(0, ~0);
+
+  cprintf("lock   cpus   acquires   avg wait   max wait  fairness\n");
+  for (kind = 0; kind < NSPINKINDS; kind++)
+    for (n = 1; n <= ncpu; n = (n * 2 > ncpu && n < ncpu) ? ncpu : n * 2)
+      run(n);
+}